@@ -2,506 +2,6097 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
 
-#define LINE_BUFFER 1024
-#define MAX_COUNTIES 1000
 #define MAX_NAME_LEN 100
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define STRING_TABLE_INITIAL_SLOTS 1024
+#define STRING_NOT_FOUND UINT32_MAX
+#define ROW_KEY_INITIAL_SLOTS 1024
+#define MIN_PARSE_CHUNK (1 << 20)
+#define PARSE_CHUNKS_PER_THREAD 4
+#define ZONE_WORDS 16   // selection words (of 64 rows) per zone map entry
+#define ZONE_ROWS (ZONE_WORDS * 64)
+#define MAX_PERCENT_FIELDS 16    // fields in one percent:A,B,C
+#define SCAN_MORSEL_WORDS 256   // selection words per parallel scan task (a multiple of ZONE_WORDS)
+#define PREFIX_CACHE_BYTES (256 << 20)  // selections and output the batch prefix cache keeps
+#define SERVER_QUEUE_SIZE 64
+#define SERVER_POLL_SECONDS 1
+#define RELOAD_BLOCK_SIZE (1 << 20)  // bytes of data file per checksummed block (--incremental)
+#define BENCH_MIN_SECONDS 0.5   // each --bench stage repeats for at least this long
 
-// Struct to store county demographics data
-
-typedef struct {
-    char county[MAX_NAME_LEN];
-    char state[MAX_NAME_LEN];
-    float education_high_school_or_higher;
-    float education_bachelors_or_higher;
-    float ethnicity_american_indian_and_alaska_native;
-    float ethnicity_asian;
-    float ethnicity_black;
-    float ethnicity_hispanic;
-    float ethnicity_native_hawaiian_and_other_pacific_islander;
-    float ethnicity_two_or_more_races;
-    float ethnicity_white;
-    float ethnicity_white_not_hispanic;
-    int median_household_income;
-    int per_capita_income;
-    float persons_below_poverty_level;
-    int population_2014;
-} CountyData;
-
-// Global array to store county data and count
-CountyData counties[MAX_COUNTIES];
-int county_count = 0;
+// Arena allocator for interned strings. Blocks are never freed individually,
+// so every string handed out stays valid for the lifetime of the process.
 
-// Function to replace underscores with spaces
-void replace_underscores_with_spaces(char *str) {
-    for (int i = 0; str[i] != '\0'; i++) {
-        if (str[i] == '_') {
-            str[i] = ' ';
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+// Interned string table: each distinct county/state name is stored once in
+// the arena and referred to by a 32-bit id.
+
+typedef struct {
+    Arena arena;
+    const char **strings;   // id -> string
+    uint32_t *lengths;      // id -> length
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *slots;        // open-addressing hash table of id + 1 (0 = empty)
+    uint32_t slot_count;
+} StringTable;
+
+// Numeric fields. Every CSV column after County and State is a field,
+// queryable under a name derived from its header. The columns of the
+// county demographics file are known in advance, with fixed ids, types and
+// (for a few) the names earlier versions used; any other header column is
+// registered as a float field when a file is first seen. Ids stay valid for
+// the life of the process.
+
+#define MAX_FIELDS 256
+
+// Ids of the known fields the code refers to directly
+typedef enum {
+    FIELD_EDUCATION_HIGH_SCHOOL_OR_HIGHER,
+    FIELD_EDUCATION_BACHELORS_OR_HIGHER,
+    FIELD_ETHNICITY_AMERICAN_INDIAN_AND_ALASKA_NATIVE,
+    FIELD_ETHNICITY_ASIAN,
+    FIELD_ETHNICITY_BLACK,
+    FIELD_ETHNICITY_HISPANIC,
+    FIELD_ETHNICITY_NATIVE_HAWAIIAN_AND_OTHER_PACIFIC_ISLANDER,
+    FIELD_ETHNICITY_TWO_OR_MORE_RACES,
+    FIELD_ETHNICITY_WHITE,
+    FIELD_ETHNICITY_WHITE_NOT_HISPANIC,
+    FIELD_MEDIAN_HOUSEHOLD_INCOME,
+    FIELD_PER_CAPITA_INCOME,
+    FIELD_PERSONS_BELOW_POVERTY_LEVEL,
+    FIELD_POPULATION_2014
+} FieldId;
+
+typedef enum {
+    COLUMN_FLOAT,
+    COLUMN_INT
+} ColumnType;
+
+typedef struct {
+    char name[MAX_NAME_LEN];    // name used by operations
+    char header[MAX_NAME_LEN];  // CSV header, also the snapshot block name
+    char alias[MAX_NAME_LEN];   // the name derived from the header, if name is not
+    ColumnType type;
+    int is_percentage;          // can be used with population: and percent:
+    int is_signed;              // values may be negative; other fields are counts, amounts or percentages
+} FieldInfo;
+
+typedef struct {
+    const char *header;
+    const char *legacy_name;    // name kept from before fields came from the header
+    ColumnType type;
+    int is_percentage;
+    int is_signed;
+} KnownField;
+
+// Known fields in id order: the FieldId ones first, then the rest in header order
+static const KnownField known_fields[] = {
+    {"Education.High School or Higher", NULL, COLUMN_FLOAT, 1, 0},
+    {"Education.Bachelor's Degree or Higher", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.American Indian and Alaska Native Alone", "Ethnicity_American_Indian_and_Alaska_Native_Alone", COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.Asian Alone", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.Black Alone", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.Hispanic or Latino", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.Native Hawaiian and Other Pacific Islander Alone", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.Two or More Races", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.White Alone", NULL, COLUMN_FLOAT, 1, 0},
+    {"Ethnicities.White Alone not Hispanic or Latino", NULL, COLUMN_FLOAT, 1, 0},
+    {"Income.Median Household Income", NULL, COLUMN_INT, 0, 0},
+    {"Income.Per Capita Income", NULL, COLUMN_INT, 0, 0},
+    {"Income.Persons Below Poverty Level", NULL, COLUMN_FLOAT, 1, 0},
+    {"Population.2014 Population", "Population_Population_2014", COLUMN_INT, 0, 0},
+    {"Age.Percent 65 and Older", NULL, COLUMN_FLOAT, 1, 0},
+    {"Age.Percent Under 18 Years", NULL, COLUMN_FLOAT, 1, 0},
+    {"Age.Percent Under 5 Years", NULL, COLUMN_FLOAT, 1, 0},
+    {"Employment.Nonemployer Establishments", NULL, COLUMN_INT, 0, 0},
+    {"Employment.Private Non-farm Employment", NULL, COLUMN_INT, 0, 0},
+    {"Employment.Private Non-farm Employment Percent Change", NULL, COLUMN_FLOAT, 0, 1},
+    {"Employment.Private Non-farm Establishments", NULL, COLUMN_INT, 0, 0},
+    {"Housing.Homeownership Rate", NULL, COLUMN_FLOAT, 0, 0},
+    {"Housing.Households", NULL, COLUMN_INT, 0, 0},
+    {"Housing.Housing Units", NULL, COLUMN_INT, 0, 0},
+    {"Housing.Median Value of Owner-Occupied Units", NULL, COLUMN_INT, 0, 0},
+    {"Housing.Persons per Household", NULL, COLUMN_FLOAT, 0, 0},
+    {"Housing.Units in Multi-Unit Structures", NULL, COLUMN_FLOAT, 0, 0},
+    {"Miscellaneous.Building Permits", NULL, COLUMN_INT, 0, 0},
+    {"Miscellaneous.Foreign Born", NULL, COLUMN_FLOAT, 1, 0},
+    {"Miscellaneous.Land Area", NULL, COLUMN_FLOAT, 0, 0},
+    {"Miscellaneous.Language Other than English at Home", NULL, COLUMN_FLOAT, 1, 0},
+    {"Miscellaneous.Living in Same House +1 Years", NULL, COLUMN_FLOAT, 1, 0},
+    {"Miscellaneous.Manufacturers Shipments", NULL, COLUMN_INT, 0, 0},
+    {"Miscellaneous.Mean Travel Time to Work", NULL, COLUMN_FLOAT, 0, 0},
+    {"Miscellaneous.Percent Female", NULL, COLUMN_FLOAT, 1, 0},
+    {"Miscellaneous.Veterans", NULL, COLUMN_INT, 0, 0},
+    {"Population.2010 Population", NULL, COLUMN_INT, 0, 0},
+    {"Population.Population Percent Change", NULL, COLUMN_FLOAT, 0, 1},
+    {"Population.Population per Square Mile", NULL, COLUMN_FLOAT, 0, 0},
+    {"Sales.Accommodation and Food Services Sales", NULL, COLUMN_INT, 0, 0},
+    {"Sales.Merchant Wholesaler Sales", NULL, COLUMN_INT, 0, 0},
+    {"Sales.Retail Sales", NULL, COLUMN_INT, 0, 0},
+    {"Sales.Retail Sales per Capita", NULL, COLUMN_INT, 0, 0},
+    {"Employment.Firms.American Indian-Owned", NULL, COLUMN_FLOAT, 0, 0},
+    {"Employment.Firms.Asian-Owned", NULL, COLUMN_FLOAT, 0, 0},
+    {"Employment.Firms.Black-Owned", NULL, COLUMN_FLOAT, 0, 0},
+    {"Employment.Firms.Hispanic-Owned", NULL, COLUMN_FLOAT, 0, 0},
+    {"Employment.Firms.Native Hawaiian and Other Pacific Islander-Owned", NULL, COLUMN_FLOAT, 0, 0},
+    {"Employment.Firms.Total", NULL, COLUMN_INT, 0, 0},
+    {"Employment.Firms.Women-Owned", NULL, COLUMN_FLOAT, 0, 0}
+};
+
+// Registered fields; entries below field_count never change once published
+FieldInfo field_info[MAX_FIELDS];
+atomic_int field_count;
+pthread_mutex_t field_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One contiguous array per field plus a validity bitmap (bit set = the row
+// held a number for this field, and not a negative one unless the field is
+// signed). Arrays are padded with
+// zeroed rows to a multiple of 64 so kernels can always read whole words.
+// The zone map holds the smallest and largest valid value of every block
+// of ZONE_ROWS rows (min > max if the block has none), so range filters
+// can settle whole blocks without reading their values.
+//
+// Columns are materialized on first use: a CSV load parses only County and
+// State, and the other columns are parsed from the retained text when an
+// operation needs them (see require_fields). A column the data does not
+// have reads as all invalid.
+typedef struct {
+    union {
+        float *f;
+        int32_t *i;
+    };
+    uint64_t *valid;
+    union {
+        float *f;
+        int32_t *i;
+    } zone_min, zone_max;
+    int source;         // CSV column the values come from, or -1
+    int present;        // the data has this column (in its CSV header or snapshot)
+    int owned;          // values and validity are on the heap rather than in a snapshot
+    int zones_owned;
+    atomic_int ready;   // values, validity and zone map are built
+} Column;
+
+#define STATE_NONE UINT32_MAX
+
+// Index over the State column, built after every load. States get dense
+// codes in alphabetical order; each state's rows are listed in row order.
+typedef struct {
+    int count;               // distinct states
+    uint32_t *name_ids;      // code -> id in names
+    uint32_t *code_by_name;  // id in names -> code, or STATE_NONE
+    uint32_t *codes;         // row -> code: the State column dictionary-encoded
+    int *row_offsets;        // rows of code c are rows[row_offsets[c] .. row_offsets[c + 1])
+    int *rows;
+} StateIndex;
+
+// (County, State) -> row, for applying upserts (see dataset_upsert).
+// Open addressing on county id << 32 | state id.
+typedef struct {
+    uint64_t *keys;
+    int *rows;          // -1 = empty slot
+    size_t slot_count;
+    size_t used;
+} RowKeyIndex;
+
+// The loaded data, stored column by column. Row r came from line
+// first_row + r + 2 of the input (line 1 is the header); first_row is only
+// nonzero for the batches of a streamed file. Once rows have been upserted
+// row_lines gives each row's line instead.
+typedef struct {
+    int row_count;
+    int first_row;
+    uint32_t *county_ids; // ids in names
+    uint32_t *state_ids;  // ids in names
+    Column columns[MAX_FIELDS];
+    StringTable names;
+    StateIndex states;
+    int *row_lines;            // row -> line it was last read from, after upserts
+    RowKeyIndex keys;          // built by the first upsert
+    const char **row_fields;   // row -> its text after the State field, while columns remain to parse
+    const char *text_end;      // end of the text row_fields point into
+    const void *text_data;     // the CSV file the rows were parsed from, if the dataset owns it
+    size_t text_size;
+    int text_mapped;
+    pthread_mutex_t *column_lock; // serializes materializing columns
+    const void *snapshot_data; // mapping the arrays point into, if loaded from a snapshot
+    size_t snapshot_size;
+    int snapshot_mapped;       // snapshot_data is an mmap rather than a heap copy
+} Dataset;
+
+typedef struct AggregateScan AggregateScan;
+
+// One run of an operation chain over a dataset: the rows still selected
+// by the filters run so far (one bit per row) and where output goes.
+// Queries never modify the dataset, so any number can share one.
+typedef struct {
+    const Dataset *ds;
+    uint64_t *selection;
+    int selected_count;
+    FILE *out;
+    FILE *err;             // where errors about the operations go
+    AggregateScan *fused;  // sums for the aggregates about to run, if scanned together
+} Query;
+
+// Profiling (--profile). While enabled, each stage of a run (the load and
+// every operation) records its wall time, rows in and out, the bytes of
+// file or column data it read and the allocations it made, and a report
+// goes to stderr at exit. While disabled every hook returns after one test.
+
+typedef enum {
+    PROFILE_OFF,
+    PROFILE_TABLE,
+    PROFILE_JSON
+} ProfileMode;
+
+typedef struct {
+    char *name;             // "load", "stream" or the operation text
+    double seconds;
+    long long rows_in;      // -1 where it does not apply
+    long long rows_out;
+    long long bytes_read;
+    long long allocations;
+    long long allocated_bytes;
+} ProfileStage;
+
+// Counter values when a stage began
+typedef struct {
+    double start;
+    long long bytes_read;
+    long long allocations;
+    long long allocated_bytes;
+} ProfileMark;
+
+ProfileMode profile_mode = PROFILE_OFF;
+atomic_llong profile_bytes_read;
+atomic_llong profile_allocations;
+atomic_llong profile_allocated_bytes;
+ProfileStage *profile_stages;
+int profile_stage_count;
+int profile_stage_capacity;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void print_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const char *p = text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*p >= 0x20) {
+            fputc(*p, out);
         }
     }
+    fputc('"', out);
 }
 
-// Helper function to trim double quotes from a string
-void trim_quotes(char *str) {
-    size_t len = strlen(str);
-    if (len > 0 && str[0] == '"' && str[len - 1] == '"') {
-        memmove(str, str + 1, len - 2);
-        str[len - 2] = '\0';
+static inline void profile_add_bytes(long long bytes) {
+    if (profile_mode != PROFILE_OFF) {
+        atomic_fetch_add_explicit(&profile_bytes_read, bytes, memory_order_relaxed);
     }
 }
 
-void parse_demographics_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error: Could not open file %s\n", filename);
-        return;
+static inline void profile_add_allocation(size_t size) {
+    if (profile_mode != PROFILE_OFF) {
+        atomic_fetch_add_explicit(&profile_allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&profile_allocated_bytes, (long long)size, memory_order_relaxed);
     }
+}
 
-    char line[LINE_BUFFER];
-    int line_number = 0;
+ProfileMark profile_begin() {
+    ProfileMark mark = {0};
+    if (profile_mode != PROFILE_OFF) {
+        mark.start = now_seconds();
+        mark.bytes_read = atomic_load(&profile_bytes_read);
+        mark.allocations = atomic_load(&profile_allocations);
+        mark.allocated_bytes = atomic_load(&profile_allocated_bytes);
+    }
+    return mark;
+}
 
-    // Skip the header line
-    if (!fgets(line, LINE_BUFFER, file)) {
-        fprintf(stderr, "Error: File is empty or malformed\n");
-        fclose(file);
+// Record a stage that began at mark. Only the main thread ends stages.
+void profile_end(const ProfileMark *mark, const char *name, long long rows_in, long long rows_out) {
+    if (profile_mode == PROFILE_OFF) {
         return;
     }
+    double end = now_seconds();
+    if (profile_stage_count == profile_stage_capacity) {
+        profile_stage_capacity = profile_stage_capacity ? profile_stage_capacity * 2 : 16;
+        profile_stages = realloc(profile_stages, profile_stage_capacity * sizeof(ProfileStage));
+        if (!profile_stages) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+    }
+    ProfileStage *stage = &profile_stages[profile_stage_count++];
+    stage->name = strdup(name);
+    stage->seconds = end - mark->start;
+    stage->rows_in = rows_in;
+    stage->rows_out = rows_out;
+    stage->bytes_read = atomic_load(&profile_bytes_read) - mark->bytes_read;
+    stage->allocations = atomic_load(&profile_allocations) - mark->allocations;
+    stage->allocated_bytes = atomic_load(&profile_allocated_bytes) - mark->allocated_bytes;
+}
 
-    // Read and process each subsequent line
-    while (fgets(line, LINE_BUFFER, file)) {
-        if (line_number == 0){
-            line_number++;
-            continue;
+void print_profile_json(FILE *out) {
+    fprintf(out, "{\"stages\":[");
+    double total = 0;
+    for (int i = 0; i < profile_stage_count; i++) {
+        const ProfileStage *stage = &profile_stages[i];
+        total += stage->seconds;
+        fprintf(out, "%s{\"stage\":", i ? "," : "");
+        print_json_string(out, stage->name);
+        fprintf(out, ",\"seconds\":%.6f", stage->seconds);
+        if (stage->rows_in >= 0) {
+            fprintf(out, ",\"rows_in\":%lld,\"rows_out\":%lld,\"selectivity\":%.4f", stage->rows_in, stage->rows_out,
+                    stage->rows_in > 0 ? (double)stage->rows_out / stage->rows_in : 0);
+        } else {
+            fprintf(out, ",\"rows_in\":null,\"rows_out\":%lld,\"selectivity\":null", stage->rows_out);
         }
-        line_number++;
-        if (county_count >= MAX_COUNTIES) {
-            fprintf(stderr, "Error: Maximum county limit reached (%d counties)\n", MAX_COUNTIES);
-            break;
+        fprintf(out, ",\"bytes_read\":%lld,\"allocations\":%lld,\"allocated_bytes\":%lld}",
+                stage->bytes_read, stage->allocations, stage->allocated_bytes);
+    }
+    fprintf(out, "],\"total_seconds\":%.6f}\n", total);
+}
+
+void print_profile_table(FILE *out) {
+    int width = (int)strlen("total");
+    for (int i = 0; i < profile_stage_count; i++) {
+        int length = (int)strlen(profile_stages[i].name);
+        width = length > width ? length : width;
+    }
+    fprintf(out, "%-*s %10s %10s %10s %11s %12s %8s %12s\n", width, "stage", "seconds", "rows in", "rows out",
+            "selectivity", "bytes read", "allocs", "alloc bytes");
+    double seconds = 0;
+    long long bytes_read = 0, allocations = 0, allocated_bytes = 0;
+    for (int i = 0; i < profile_stage_count; i++) {
+        const ProfileStage *stage = &profile_stages[i];
+        char rows_in[24] = "-", selectivity[24] = "-";
+        if (stage->rows_in >= 0) {
+            snprintf(rows_in, sizeof(rows_in), "%lld", stage->rows_in);
+            snprintf(selectivity, sizeof(selectivity), "%.2f%%",
+                     stage->rows_in > 0 ? 100.0 * stage->rows_out / stage->rows_in : 0);
         }
+        fprintf(out, "%-*s %10.6f %10s %10lld %11s %12lld %8lld %12lld\n", width, stage->name, stage->seconds,
+                rows_in, stage->rows_out, selectivity, stage->bytes_read, stage->allocations, stage->allocated_bytes);
+        seconds += stage->seconds;
+        bytes_read += stage->bytes_read;
+        allocations += stage->allocations;
+        allocated_bytes += stage->allocated_bytes;
+    }
+    fprintf(out, "%-*s %10.6f %10s %10s %11s %12lld %8lld %12lld\n", width, "total", seconds, "", "", "",
+            bytes_read, allocations, allocated_bytes);
+}
+
+// Registered with atexit when profiling is on
+void print_profile() {
+    fflush(stdout);
+    if (profile_mode == PROFILE_JSON) {
+        print_profile_json(stderr);
+    } else {
+        print_profile_table(stderr);
+    }
+    for (int i = 0; i < profile_stage_count; i++) {
+        free(profile_stages[i].name);
+    }
+    free(profile_stages);
+}
 
-        // Tokenize the line by commas
-        char *token;
-        int field_index = 0;
-        CountyData county = {0}; // Temporary struct to store the data
-
-        token = strtok(line, ",");
-        while (token) {
-            trim_quotes(token); // Remove surrounding double quotes
-
-            // Assign values to the struct fields based on the index
-            switch (field_index) {
-                case 0: // County
-                    strncpy(county.county, token, MAX_NAME_LEN - 1);
-                    break;
-                case 1: // State
-                    strncpy(county.state, token, MAX_NAME_LEN - 1);
-                    break;
-                case 5: // Education.Bachelors Degree or Higher
-                    county.education_bachelors_or_higher = atof(token);
-                    break;
-                case 6: // Education.High School or Higher
-                    county.education_high_school_or_higher = atof(token);
-                    break;
-                case 11: // Ethnicities.American Indian and Alaska Native Alone
-                    county.ethnicity_american_indian_and_alaska_native = atof(token);
-                    break;
-                case 12: // Ethnicities.Asian alone
-                    county.ethnicity_asian = atof(token);
-                    break;
-                case 13: // Ethnicities.Black Alone
-                    county.ethnicity_black = atof(token);
-                    break;
-                case 14: // Ethnicities.Hispanic or Latino
-                    county.ethnicity_hispanic = atof(token);
-                    break;
-                case 15: // Ethnicities.Native Hawaiian and Other pacific Islander Alone
-                    county.ethnicity_native_hawaiian_and_other_pacific_islander = atof(token);
-                    break;
-                case 16: // Ethnicities.two or more races
-                    county.ethnicity_two_or_more_races = atof(token);
-                    break;
-                case 17: // Ethnicities.White alone
-                    county.ethnicity_white = atof(token);
-                    break;
-                case 18: // Ethnicities.White alone not hispanic or latino
-                    county.ethnicity_white_not_hispanic = atof(token);
-                    break;
-                case 25: // Income.Median Household Income
-                    county.median_household_income = atoi(token);
-                    break;
-                case 26: // Income.Per Capita Income
-                    county.per_capita_income = atoi(token);
-                    break;
-                case 27: // Income.Persons Below Poverty Level
-                    county.persons_below_poverty_level = atof(token);
-                    break;
-                case 38: // Population.2014 Population
-                    county.population_2014 = atoi(token);
-                    break;
-                default:
-                    break;
-            }
-
-            // Get the next token
-            token = strtok(NULL, ",");
-            field_index++;
-        }
-
-        // Add the county to the array
-        counties[county_count++] = county;
+void *xmalloc(size_t size) {
+    profile_add_allocation(size);
+    void *ptr = malloc(size);
+    if (!ptr) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
     }
+    return ptr;
+}
 
-    fclose(file);
-    printf("%d entries loaded successfully.\n", county_count);
+void *xrealloc(void *old, size_t size) {
+    profile_add_allocation(size);
+    void *ptr = realloc(old, size);
+    if (!ptr) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    return ptr;
 }
 
+void *xcalloc(size_t count, size_t size) {
+    profile_add_allocation(count * size);
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
 
-// Function to display all counties
-void display_counties() {
-    printf("Displaying County Data:\n");
-    printf("----------------------------------------------------------\n");
-    for (int i = 0; i < county_count; i++) {
-        CountyData *c = &counties[i];
-        printf("County: %s, State: %s\n", c->county, c->state);
-        printf("  Education (High School or Higher): %.2f%%\n", c->education_high_school_or_higher);
-        printf("  Education (Bachelors or Higher): %.2f%%\n", c->education_bachelors_or_higher);
-        printf("  Ethnicities:\n");
-        printf("    White: %.2f%%, Black: %.2f%%, Asian: %.2f%%, Hispanic: %.2f%%, Native Hawaiian:%.2f%%, White Alone:%.2f%%, American Indian:%.2f%%, Two or More Races:%.2f%%\n",
-               c->ethnicity_white, c->ethnicity_black, c->ethnicity_asian, c->ethnicity_hispanic, c->ethnicity_native_hawaiian_and_other_pacific_islander, c->ethnicity_white_not_hispanic,c->ethnicity_american_indian_and_alaska_native,c->ethnicity_two_or_more_races);
-        printf("  Income:\n");
-        printf("    Median Household: $%d, Per Capita: $%d, Below Poverty: %.2f%%\n",
-               c->median_household_income, c->per_capita_income, c->persons_below_poverty_level);
-        printf("  Population (2014): %d\n", c->population_2014);
-        printf("----------------------------------------------------------\n");
+// Allocate size bytes from the arena, starting a new block when the current one is full
+void *arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->head;
+    if (!block || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = xmalloc(sizeof(ArenaBlock) + block_size);
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
     }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
 }
 
+void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
 
-// Function to filter counties by state abbreviation
-void filter_state(const char *state_abbr) {
-    int filtered_count = 0;
+// FNV-1a hash of a length-delimited string
+uint32_t hash_string(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    // Filter entries
-    for (int i = 0; i < county_count; i++) {
-        if (strcmp(counties[i].state, state_abbr) == 0) {
-            counties[filtered_count++] = counties[i];
+// Rebuild the hash slots with twice as many entries
+void string_table_grow_slots(StringTable *table) {
+    uint32_t new_count = table->slot_count ? table->slot_count * 2 : STRING_TABLE_INITIAL_SLOTS;
+    uint32_t *new_slots = xcalloc(new_count, sizeof(uint32_t));
+    for (uint32_t id = 0; id < table->count; id++) {
+        uint32_t slot = hash_string(table->strings[id], table->lengths[id]) & (new_count - 1);
+        while (new_slots[slot]) {
+            slot = (slot + 1) & (new_count - 1);
         }
+        new_slots[slot] = id + 1;
     }
+    free(table->slots);
+    table->slots = new_slots;
+    table->slot_count = new_count;
+}
 
-    // Update the global county count
-    county_count = filtered_count;
+// Look up a string without inserting it; returns STRING_NOT_FOUND if absent
+uint32_t string_table_find(const StringTable *table, const char *str, size_t len) {
+    if (!table->slot_count) {
+        return STRING_NOT_FOUND;
+    }
+    uint32_t slot = hash_string(str, len) & (table->slot_count - 1);
+    while (table->slots[slot]) {
+        uint32_t id = table->slots[slot] - 1;
+        if (table->lengths[id] == len && memcmp(table->strings[id], str, len) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+    return STRING_NOT_FOUND;
+}
 
-    // Print the result
-    printf("Filter: state == %s (%d entries)\n", state_abbr, county_count);
-}
-
-void filter_field(const char *field, const char *comparison, float value) {
-    int filtered_count = 0;
-
-    // Field validation: Check if the field is supported
-    int valid_field = 0;
-
-    // List of supported fields
-    const char *valid_fields[] = {
-        "County",
-        "State",
-        "Education_High_School_or_Higher",
-        "Education_Bachelors_Degree_or_Higher",
-        "Ethnicity_American_Indian_and_Alaska_Native_Alone",
-        "Ethnicities_Asian_Alone",
-        "Ethnicities_Black_Alone",
-        "Ethnicities_Hispanic_or_Latino",
-        "Ethnicities_Native_Hawaiian_and_Other_Pacific_Islander_Alone",
-        "Ethnicities_Two_or_More_Races",
-        "Ethnicities_White_Alone",
-        "Ethnicities_White_Alone_not_Hispanic_or_Latino",
-        "Income_Median_Household_Income",
-        "Income_Per_Capita_Income",
-        "Income_Persons_Below_Poverty_Level",
-        "Population_Population_2014"
-    };
+// Return the id of str, adding a copy to the table if it is not there yet
+uint32_t string_table_intern(StringTable *table, const char *str, size_t len) {
+    uint32_t id = string_table_find(table, str, len);
+    if (id != STRING_NOT_FOUND) {
+        return id;
+    }
 
-    // Validate the field name
-    for (int i = 0; i < sizeof(valid_fields) / sizeof(valid_fields[0]); i++) {
-        if (strcmp(field, valid_fields[i]) == 0) {
-            valid_field = 1;
-            break;
-        }
+    // Keep the load factor under one half
+    if ((table->count + 1) * 2 > table->slot_count) {
+        string_table_grow_slots(table);
+    }
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : STRING_TABLE_INITIAL_SLOTS;
+        table->strings = xrealloc(table->strings, table->capacity * sizeof(char *));
+        table->lengths = xrealloc(table->lengths, table->capacity * sizeof(uint32_t));
     }
 
-    if (!valid_field) {
-        fprintf(stderr, "Error: Unsupported field '%s'\n", field);
-        return;
+    char *copy = arena_alloc(&table->arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+
+    id = table->count++;
+    table->strings[id] = copy;
+    table->lengths[id] = (uint32_t)len;
+
+    uint32_t slot = hash_string(str, len) & (table->slot_count - 1);
+    while (table->slots[slot]) {
+        slot = (slot + 1) & (table->slot_count - 1);
     }
+    table->slots[slot] = id + 1;
+    return id;
+}
 
-    // Loop through counties to filter data
-    for (int i = 0; i < county_count; i++) {
-        int matches = 0;
+const char *string_table_get(const StringTable *table, uint32_t id) {
+    return table->strings[id];
+}
 
-        // Perform filtering based on the field
-        if (strcmp(field, "Education_High_School_or_Higher") == 0) {
-            if (counties[i].education_high_school_or_higher < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].education_high_school_or_higher >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].education_high_school_or_higher <= value);
-        } else if (strcmp(field, "County") == 0) {
-                printf("Non-numeric values in field: %s (Line %d)\n", field, i + 2);
-                continue;
-        } else if (strcmp(field, "State") == 0) {
-                printf("Non-numeric values in field: %s (Line %d)\n", field, i + 2);
-                continue;
-        } else if (strcmp(field, "Education_Bachelors_Degree_or_Higher") == 0) {
-            if (counties[i].education_bachelors_or_higher < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].education_bachelors_or_higher >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].education_bachelors_or_higher <= value);
-        } else if (strcmp(field, "Ethnicity_American_Indian_and_Alaska_Native_Alone") == 0) {
-            if (counties[i].ethnicity_american_indian_and_alaska_native < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_american_indian_and_alaska_native >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_american_indian_and_alaska_native <= value);
-        } else if (strcmp(field, "Ethnicities_Asian_Alone") == 0) {
-            if (counties[i].ethnicity_asian < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_asian >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_asian <= value);
-        } else if (strcmp(field, "Ethnicities_Black_Alone") == 0) {
-            if (counties[i].ethnicity_black < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_black >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_black <= value);
-        } else if (strcmp(field, "Ethnicities_Hispanic_or_Latino") == 0) {
-            if (counties[i].ethnicity_hispanic < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_hispanic >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_hispanic <= value);
-        } else if (strcmp(field, "Ethnicities_Native_Hawaiian_and_Other_Pacific_Islander_Alone") == 0) {
-            if (counties[i].ethnicity_native_hawaiian_and_other_pacific_islander < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_native_hawaiian_and_other_pacific_islander >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_native_hawaiian_and_other_pacific_islander <= value);
-        } else if (strcmp(field, "Ethnicities_Two_or_More_Races") == 0) {
-            if (counties[i].ethnicity_two_or_more_races < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_two_or_more_races >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_two_or_more_races <= value);
-        } else if (strcmp(field, "Ethnicities_White_Alone") == 0) {
-            if (counties[i].ethnicity_white < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_white >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_white <= value);
-        } else if (strcmp(field, "Ethnicities_White_Alone_not_Hispanic_or_Latino") == 0) {
-            if (counties[i].ethnicity_white_not_hispanic < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
-            }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].ethnicity_white_not_hispanic >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].ethnicity_white_not_hispanic <= value);
-        } else if (strcmp(field, "Income_Median_Household_Income") == 0) {
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].median_household_income >= (int)value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].median_household_income <= (int)value);
-        } else if (strcmp(field, "Income_Per_Capita_Income") == 0) {
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].per_capita_income >= (int)value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].per_capita_income <= (int)value);
-        } else if (strcmp(field, "Income_Persons_Below_Poverty_Level") == 0) {
-            if (counties[i].persons_below_poverty_level < 0) {
-                printf("Warning: Line %d contains invalid data and will be skipped.\n", i + 2);
-                continue;
+void string_table_free(StringTable *table) {
+    arena_free(&table->arena);
+    free(table->strings);
+    free(table->lengths);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+#define BITMAP_WORDS(bits) (((size_t)(bits) + 63) / 64)
+
+static inline int bitmap_test(const uint64_t *bits, int index) {
+    return (bits[index >> 6] >> (index & 63)) & 1;
+}
+
+// Look up a field by its operation name; returns -1 if there is no such field
+int find_field(const char *name) {
+    int count = atomic_load(&field_count);
+    for (int f = 0; f < count; f++) {
+        if (strcmp(name, field_info[f].name) == 0 || (field_info[f].alias[0] && strcmp(name, field_info[f].alias) == 0)) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+// Field names are headers with runs of spaces, dots and dashes turned into
+// one underscore and other punctuation dropped: "Housing.Housing Units"
+// becomes Housing_Housing_Units
+void field_name_from_header(const char *header, char *name, size_t size) {
+    size_t length = 0;
+    int gap = 0;
+    for (const char *p = header; *p && length + 1 < size; p++) {
+        if (isalnum((unsigned char)*p)) {
+            if (gap && length > 0 && length + 2 < size) {
+                name[length++] = '_';
             }
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].persons_below_poverty_level >= value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].persons_below_poverty_level <= value);
-        } else if (strcmp(field, "Population_Population_2014") == 0) {
-            matches = (strcmp(comparison, "ge") == 0 && counties[i].population_2014 >= (int)value) ||
-                      (strcmp(comparison, "le") == 0 && counties[i].population_2014 <= (int)value);
+            name[length++] = *p;
+            gap = 0;
+        } else if (*p == ' ' || *p == '.' || *p == '-' || *p == '_') {
+            gap = 1;
         }
+    }
+    name[length] = '\0';
+}
 
-        if (matches) {
-            counties[filtered_count++] = counties[i];
+int find_field_by_header(const char *header) {
+    int count = atomic_load(&field_count);
+    for (int f = 0; f < count; f++) {
+        if (strcmp(header, field_info[f].header) == 0) {
+            return f;
         }
     }
+    return -1;
+}
 
-    // Update the global county count
-    county_count = filtered_count;
+// Id of the field with this header, registering it if it is new. Returns
+// -1 once MAX_FIELDS fields exist.
+int register_field(const char *header, ColumnType type) {
+    int f = find_field_by_header(header);
+    if (f >= 0) {
+        return f;
+    }
+    pthread_mutex_lock(&field_lock);
+    f = find_field_by_header(header);
+    int count = atomic_load(&field_count);
+    if (f < 0 && count < MAX_FIELDS) {
+        FieldInfo *info = &field_info[count];
+        snprintf(info->header, sizeof(info->header), "%s", header);
+        field_name_from_header(header, info->name, sizeof(info->name));
+        info->type = type;
+        info->is_percentage = 0;
+        info->is_signed = 1;    // nothing is known about its values
+        atomic_store(&field_count, count + 1);
+        f = count;
+    }
+    pthread_mutex_unlock(&field_lock);
+    return f;
+}
 
-    // Print the result
-    printf("Filter: %s %s %.2f (%d entries)\n", field, comparison, value, county_count);
+// Register the known fields; their ids are their positions in known_fields
+void init_field_lookup() {
+    int count = (int)(sizeof(known_fields) / sizeof(known_fields[0]));
+    for (int f = 0; f < count; f++) {
+        FieldInfo *info = &field_info[f];
+        snprintf(info->header, sizeof(info->header), "%s", known_fields[f].header);
+        field_name_from_header(info->header, info->name, sizeof(info->name));
+        if (known_fields[f].legacy_name) {
+            memcpy(info->alias, info->name, sizeof(info->alias));
+            snprintf(info->name, sizeof(info->name), "%s", known_fields[f].legacy_name);
+        }
+        info->type = known_fields[f].type;
+        info->is_percentage = known_fields[f].is_percentage;
+        info->is_signed = known_fields[f].is_signed;
+    }
+    atomic_store(&field_count, count);
+}
+
+// Give a dataset its column lock and mark every column as not in the data
+void dataset_init_columns(Dataset *ds) {
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        ds->columns[f].source = -1;
+    }
+    ds->column_lock = xmalloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(ds->column_lock, NULL);
+}
+
+// Allocate the name columns for row_count rows; the other columns are
+// allocated as they are materialized
+void dataset_allocate(Dataset *ds, int row_count) {
+    size_t rows = BITMAP_WORDS(row_count > 0 ? row_count : 1) * 64;
+    ds->row_count = row_count;
+    ds->county_ids = xcalloc(rows, sizeof(uint32_t));
+    ds->state_ids = xcalloc(rows, sizeof(uint32_t));
+    ds->row_fields = xcalloc(rows, sizeof(const char *));
+    dataset_init_columns(ds);
+}
+
+size_t selection_words(const Dataset *ds) {
+    return BITMAP_WORDS(ds->row_count > 0 ? ds->row_count : 1);
+}
+
+// Line number reported for row
+int line_of_row(const Dataset *ds, size_t row) {
+    return ds->row_lines ? ds->row_lines[row] : ds->first_row + (int)row + 2;
 }
 
-long long population_total() {
-    long long total_population = 0; // Use long long to handle potentially large totals.
+size_t zone_count(const Dataset *ds) {
+    return (selection_words(ds) + ZONE_WORDS - 1) / ZONE_WORDS;
+}
 
-    // Iterate over all counties
-    for (int i = 0; i < county_count; i++) {
-    if (counties[i].population_2014 < 0) {
-        printf("Warning: Line %d contains invalid population data and will be skipped.\n", i + 2);
-        continue;
+// Start a query over ds with every row selected
+void query_init(Query *q, const Dataset *ds, FILE *out, FILE *err) {
+    size_t words = selection_words(ds);
+    q->ds = ds;
+    q->out = out;
+    q->err = err;
+    q->fused = NULL;
+    q->selection = xmalloc(words * sizeof(uint64_t));
+    memset(q->selection, 0xff, words * sizeof(uint64_t));
+    if (ds->row_count % 64) {
+        q->selection[words - 1] = (1ULL << (ds->row_count % 64)) - 1;
+    } else if (ds->row_count == 0) {
+        q->selection[0] = 0;
     }
-    total_population += counties[i].population_2014;
-    //printf("Adding %d from %s. Total so far: %lld\n", counties[i].population_2014, counties[i].county, total_population);
+    q->selected_count = ds->row_count;
 }
 
+void aggregate_scan_free(AggregateScan *scan);
 
-    // Print the total population
-    printf("2014 population: %lld\n", total_population);
-    return total_population;
+void query_free(Query *q) {
+    free(q->selection);
+    q->selection = NULL;
+    if (q->fused) {
+        aggregate_scan_free(q->fused);
+        q->fused = NULL;
+    }
 }
 
-long long population_field(const char *field) {
-    const char *valid_fields[] = {
-        "Education_High_School_or_Higher",
-        "Education_Bachelors_Degree_or_Higher",
-        "Ethnicity_American_Indian_and_Alaska_Native_Alone",
-        "Ethnicities_Asian_Alone",
-        "Ethnicities_Black_Alone",
-        "Ethnicities_Hispanic_or_Latino",
-        "Ethnicities_Native_Hawaiian_and_Other_Pacific_Islander_Alone",
-        "Ethnicities_Two_or_More_Races",
-        "Ethnicities_White_Alone",
-        "Ethnicities_White_Alone_not_Hispanic_or_Latino",
-        "Income_Persons_Below_Poverty_Level"
-    };
-    const int valid_field_count = sizeof(valid_fields) / sizeof(valid_fields[0]);
+int bitmap_count(const uint64_t *bits, size_t words) {
+    int count = 0;
+    for (size_t w = 0; w < words; w++) {
+        count += __builtin_popcountll(bits[w]);
+    }
+    return count;
+}
+
+// Copy count bits of src, starting at bit from, into dst starting at bit to
+void bitmap_copy(uint64_t *dst, size_t to, const uint64_t *src, size_t from, size_t count) {
+    while (count > 0) {
+        size_t n = 64 - (from & 63);
+        n = 64 - (to & 63) < n ? 64 - (to & 63) : n;
+        n = count < n ? count : n;
+        uint64_t mask = n == 64 ? ~0ULL : (1ULL << n) - 1;
+        uint64_t bits = (src[from >> 6] >> (from & 63)) & mask;
+        dst[to >> 6] = (dst[to >> 6] & ~(mask << (to & 63))) | bits << (to & 63);
+        from += n;
+        to += n;
+        count -= n;
+    }
+}
+
+// Fixed-size pool of worker threads that run batches of indexed tasks.
+// The calling thread takes part in every batch, so a pool with zero
+// workers simply runs everything inline.
+
+typedef void (*PoolTaskFn)(void *arg, int task_index);
+
+typedef struct {
+    pthread_t *threads;
+    int worker_count;
+    pthread_mutex_t run_lock; // held by whoever is running a batch
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned generation;    // bumped each time a new batch is posted
+    int shutting_down;
+    int busy_workers;
+    PoolTaskFn fn;
+    void *arg;
+    int task_count;
+    atomic_int next_task;
+} ThreadPool;
+
+int thread_count_option = 0; // 0 = one thread per online CPU
+ThreadPool *thread_pool = NULL;
+
+// Claim and run tasks from the current batch until none are left
+void thread_pool_drain(ThreadPool *pool) {
+    int task;
+    while ((task = atomic_fetch_add(&pool->next_task, 1)) < pool->task_count) {
+        pool->fn(pool->arg, task);
+    }
+}
+
+void *thread_pool_worker(void *data) {
+    ThreadPool *pool = data;
+    unsigned seen = 0;
 
-    // Check if the specified field is valid (case-sensitive)
-    const char *matching_field = NULL;
-    for (int i = 0; i < valid_field_count; i++) {
-        if (strcmp(field, valid_fields[i]) == 0) {
-            matching_field = valid_fields[i];
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutting_down) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutting_down) {
             break;
         }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        thread_pool_drain(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_workers == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    // Exit if the field is invalid
-    if (!matching_field) {
-        fprintf(stderr, "Error: Invalid field '%s'.\n", field);
-        exit(1);
+ThreadPool *thread_pool_create(int worker_count) {
+    ThreadPool *pool = xcalloc(1, sizeof(ThreadPool));
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->threads = xcalloc(worker_count > 0 ? worker_count : 1, sizeof(pthread_t));
+    // Workers start with every signal blocked, leaving them to the thread
+    // that waits for them (see run_server)
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
+            break;
+        }
+        pool->worker_count++;
     }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return pool;
+}
 
-    long long total_sub_population = 0;
+void thread_pool_destroy(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
 
-    // Process each county entry
-    for (int i = 0; i < county_count; i++) {
-        if (counties[i].population_2014 < 0) {
-            printf("Warning: Line %d contains invalid population data and will be skipped.\n", i + 2);
-            continue;
+// Run fn(arg, 0 .. task_count - 1) across the pool and wait for all of them.
+// If another thread is already using the pool (server workers share it),
+// the tasks run inline on the caller instead.
+void thread_pool_run(ThreadPool *pool, int task_count, PoolTaskFn fn, void *arg) {
+    if (pthread_mutex_trylock(&pool->run_lock) != 0) {
+        for (int task = 0; task < task_count; task++) {
+            fn(arg, task);
         }
+        return;
+    }
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->task_count = task_count;
+    atomic_store(&pool->next_task, 0);
 
-        float percentage;
-        if (strcmp(matching_field, "Education_Bachelors_Degree_or_Higher") == 0) {
-            percentage = counties[i].education_bachelors_or_higher;
-        } else if (strcmp(matching_field, "Education_High_School_or_Higher") == 0) {
-            percentage = counties[i].education_high_school_or_higher;
-        } else if (strcmp(matching_field, "Ethnicity_American_Indian_and_Alaska_Native_Alone") == 0) {
-            percentage = counties[i].ethnicity_american_indian_and_alaska_native;
-        } else if (strcmp(matching_field, "Ethnicities_Asian_Alone") == 0) {
-            percentage = counties[i].ethnicity_asian;
-        } else if (strcmp(matching_field, "Ethnicities_Black_Alone") == 0) {
-            percentage = counties[i].ethnicity_black;
-        } else if (strcmp(matching_field, "Ethnicities_Hispanic_or_Latino") == 0) {
-            percentage = counties[i].ethnicity_hispanic;
-        } else if (strcmp(matching_field, "Ethnicities_Native_Hawaiian_and_Other_Pacific_Islander_Alone") == 0) {
-            percentage = counties[i].ethnicity_native_hawaiian_and_other_pacific_islander;
-        } else if (strcmp(matching_field, "Ethnicities_Two_or_More_Races") == 0) {
-            percentage = counties[i].ethnicity_two_or_more_races;
-        } else if (strcmp(matching_field, "Ethnicities_White_Alone") == 0) {
-            percentage = counties[i].ethnicity_white;
-        } else if (strcmp(matching_field, "Ethnicities_White_Alone_not_Hispanic_or_Latino") == 0) {
-            percentage = counties[i].ethnicity_white_not_hispanic;
-        } else if (strcmp(matching_field, "Income_Persons_Below_Poverty_Level") == 0) {
-            percentage = counties[i].persons_below_poverty_level;
-        }
-
-        if (percentage < 0 || percentage > 100) {
-            printf("Warning: Line %d contains invalid percentage data for '%s' and will be skipped.\n", i + 2, matching_field);
-            continue;
-        }
+    pthread_mutex_lock(&pool->lock);
+    pool->busy_workers = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    thread_pool_drain(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy_workers > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
 
-        // Accumulate sub-population (percentage is divided by 100 to convert to a fraction)
-        total_sub_population += (long long)((percentage / 100) * counties[i].population_2014);
+int configured_thread_count() {
+    if (thread_count_option > 0) {
+        return thread_count_option;
     }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
 
-    // Print the total sub-population
-    printf("2014 %s population: %lld\n", matching_field, total_sub_population);
-    return total_sub_population;
+// The shared pool, created on first use with one thread per configured CPU
+ThreadPool *get_thread_pool() {
+    if (!thread_pool) {
+        thread_pool = thread_pool_create(configured_thread_count() - 1);
+    }
+    return thread_pool;
 }
 
+// Morsel-driven scans: the selection is cut into morsels of
+// SCAN_MORSEL_WORDS words that pool threads claim one at a time as they
+// free up, so a thread that finishes early takes over the remaining work.
+// Partial results are kept per morsel, never per thread, and combined in
+// morsel order, which makes every result independent of --threads.
 
-void percent_sub_population(const char *field){
-    long long total_population = population_total();
-    long long total_sub_population = population_field(field);
-    double percentage = ((double)total_sub_population / total_population) * 100;
-    printf("2014 %s percentage: %.2f%%\n", field, percentage);
+int morsel_count(const Dataset *ds) {
+    return (int)((selection_words(ds) + SCAN_MORSEL_WORDS - 1) / SCAN_MORSEL_WORDS);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Invalid argument count\nUsage: %s <data_file> <operation1> [<operation2> ...]\n", argv[0]);
-        return 1;
+// Selection words first .. last - 1 of a morsel
+void morsel_words(const Dataset *ds, int morsel, size_t *first, size_t *last) {
+    *first = (size_t)morsel * SCAN_MORSEL_WORDS;
+    *last = *first + SCAN_MORSEL_WORDS < selection_words(ds) ? *first + SCAN_MORSEL_WORDS : selection_words(ds);
+}
+
+// Run fn for every morsel of ds; a single morsel runs inline
+void run_morsels(const Dataset *ds, PoolTaskFn fn, void *arg) {
+    int count = morsel_count(ds);
+    if (count == 1) {
+        fn(arg, 0);
+    } else {
+        thread_pool_run(get_thread_pool(), count, fn, arg);
     }
+}
 
-    const char *data_file = argv[1];
+// Function to replace underscores with spaces
+void replace_underscores_with_spaces(char *str) {
+    for (int i = 0; str[i] != '\0'; i++) {
+        if (str[i] == '_') {
+            str[i] = ' ';
+        }
+    }
+}
 
-    // Parse the demographics file
-    parse_demographics_file(data_file);
-
-    // Loop through all operations
-    for (int i = 2; i < argc; i++) {
-        const char *operation = argv[i];
-
-        if (strcmp(operation, "display") == 0) {
-            display_counties();
-        } 
-        else if (strncmp(operation, "filter-state:", 13) == 0) {
-            const char *state_abbr = operation + 13;
-            filter_state(state_abbr);
-        }
-        else if (strncmp(operation, "filter:", 7) == 0) {
-            char field[MAX_NAME_LEN];
-            char ge_le[3];
-            float value;
-            
-            // Adjust parsing to handle underscores and validate the operation format
-            if (sscanf(operation + 7, "%99[^:]:%2s:%f", field, ge_le, &value) == 3) {
-                filter_field(field, ge_le, value);
-            } else {
-                fprintf(stderr, "Invalid filter operation format. Use: filter:<field>:<ge|le>:<value>\n");
-                return 1;
+// A read-only view of a whole input file: either an mmap of it or, for
+// inputs that cannot be mapped (pipes, empty files) and when asked to
+// copy, a heap copy. A copy is not affected by later writes to the file,
+// which can change or (by truncating it) invalidate a mapping.
+typedef struct {
+    const char *data;
+    size_t size;
+    int mapped;
+} MappedFile;
+
+int map_file(const char *filename, MappedFile *mf, int copy) {
+    mf->data = NULL;
+    mf->size = 0;
+    mf->mapped = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+    if (regular && !copy) {
+        void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            mf->data = addr;
+            mf->size = (size_t)st.st_size;
+            mf->mapped = 1;
+            return 0;
+        }
+    }
+
+    // Not mappable: slurp it into memory instead
+    size_t cap = regular ? (size_t)st.st_size + 1 : 64 * 1024, size = 0;
+    char *buf = xmalloc(cap);
+    ssize_t n;
+    while ((n = read(fd, buf + size, cap - size)) > 0) {
+        size += (size_t)n;
+        if (size == cap) {
+            cap *= 2;
+            buf = xrealloc(buf, cap);
+        }
+    }
+    close(fd);
+    if (n < 0) {
+        free(buf);
+        return -1;
+    }
+    mf->data = buf;
+    mf->size = size;
+    return 0;
+}
+
+void unmap_file(MappedFile *mf) {
+    if (mf->mapped) {
+        munmap((void *)mf->data, mf->size);
+    } else {
+        free((void *)mf->data);
+    }
+    mf->data = NULL;
+    mf->size = 0;
+}
+
+// One CSV field as a slice of the input buffer, with surrounding quotes removed
+typedef struct {
+    const char *start;
+    const char *end;
+    int has_escaped_quotes; // field contains "" and must be unescaped before use
+} CsvField;
+
+// Read the field starting at p and return the position just past its
+// delimiter. Commas inside double quotes do not end the field.
+const char *csv_next_field(const char *p, const char *line_end, CsvField *field) {
+    field->has_escaped_quotes = 0;
+    if (p < line_end && *p == '"') {
+        p++;
+        field->start = p;
+        for (;;) {
+            const char *quote = memchr(p, '"', (size_t)(line_end - p));
+            if (!quote) {
+                // Unterminated quote: take the rest of the line
+                field->end = line_end;
+                return line_end;
+            }
+            if (quote + 1 < line_end && quote[1] == '"') {
+                field->has_escaped_quotes = 1;
+                p = quote + 2;
+                continue;
             }
+            field->end = quote;
+            p = quote + 1;
+            break;
         }
-        else if (strcmp(operation, "population-total") == 0) {
-            population_total();
+        // Skip anything between the closing quote and the delimiter
+        while (p < line_end && *p != ',') {
+            p++;
         }
-        else if (strncmp(operation, "population:", 11) == 0) {
-            const char *field = operation + 11;
-            population_field(field);
+    } else {
+        field->start = p;
+        while (p < line_end && *p != ',') {
+            p++;
         }
-        else if (strncmp(operation, "percent:", 8) == 0) {
-            const char *field = operation + 8;
-            percent_sub_population(field);
+        field->end = p;
+    }
+    return p < line_end ? p + 1 : line_end;
+}
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Slow path shared by the number parsers: copy the field and hand it to libc
+double parse_number_fallback(const char *start, const char *end, int *ok) {
+    char buf[64];
+    size_t len = (size_t)(end - start);
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    char *parsed_end;
+    double value = strtod(buf, &parsed_end);
+    *ok = parsed_end != buf;
+    return value;
+}
+
+// Parse a decimal number in place, giving the same result as atof on the
+// field. Plain "[-]digits[.digits]" values with up to 15 significant
+// digits are exact: both the mantissa and the power of ten are exactly
+// representable, so one correctly rounded division matches strtod.
+// *ok is cleared when the field does not start with a number.
+double parse_double_field(const char *start, const char *end, int *ok) {
+    const char *p = start;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0, fraction_digits = 0;
+    while (p < end && (unsigned)(*p - '0') < 10) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        digits++;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && (unsigned)(*p - '0') < 10) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits++;
+            fraction_digits++;
+            p++;
         }
-        else {
-            fprintf(stderr, "Unknown operation: %s\n", operation);
-            return 1;
+    }
+
+    if (p != end || digits == 0 || digits > 15) {
+        return parse_number_fallback(start, end, ok);
+    }
+    *ok = 1;
+    double value = (double)mantissa / powers_of_ten[fraction_digits];
+    return negative ? -value : value;
+}
+
+float parse_float_field(const char *start, const char *end, int *ok) {
+    return (float)parse_double_field(start, end, ok);
+}
+
+// Parse an integer in place with atoi semantics (stops at the first non-digit)
+int parse_int_field(const char *start, const char *end, int *ok) {
+    const char *p = start;
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    const char *digits = p;
+    int value = 0;
+    while (p < end && (unsigned)(*p - '0') < 10) {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    *ok = p > digits;
+    return negative ? -value : value;
+}
+
+// Intern a field's text, collapsing "" escapes when present
+uint32_t intern_field(StringTable *table, const CsvField *field) {
+    size_t len = (size_t)(field->end - field->start);
+    if (!field->has_escaped_quotes) {
+        return string_table_intern(table, field->start, len);
+    }
+    char *buf = xmalloc(len);
+    size_t out = 0;
+    for (const char *p = field->start; p < field->end; p++) {
+        buf[out++] = *p;
+        if (*p == '"' && p + 1 < field->end && p[1] == '"') {
+            p++;
         }
     }
+    uint32_t id = string_table_intern(table, buf, out);
+    free(buf);
+    return id;
+}
 
-    return 0;
-}
\ No newline at end of file
+// Read a header line: register its columns after County and State as
+// fields and record in sources, per field id, which CSV column holds it
+// (-1 for fields the file does not have). A repeated header is ignored.
+void read_header(const char *line, const char *line_end, int *sources) {
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        sources[f] = -1;
+    }
+    if (line_end > line && line_end[-1] == '\r') {
+        line_end--;
+    }
+    const char *p = line;
+    CsvField field;
+    int warned = 0;
+    for (int column = 0; p < line_end; column++) {
+        p = csv_next_field(p, line_end, &field);
+        if (column < 2) {
+            continue;
+        }
+        char header[MAX_NAME_LEN];
+        size_t length = 0;
+        for (const char *c = field.start; c < field.end && length + 1 < sizeof(header); c++) {
+            header[length++] = *c;
+            if (*c == '"' && c + 1 < field.end && c[1] == '"') {
+                c++;
+            }
+        }
+        header[length] = '\0';
+        int known = find_field_by_header(header);
+        int f = known >= 0 ? known : register_field(header, COLUMN_FLOAT);
+        if (f < 0) {
+            if (!warned) {
+                fprintf(stderr, "Warning: Only %d fields are supported; ignoring column %s and later new columns\n", MAX_FIELDS, header);
+                warned = 1;
+            }
+        } else if (sources[f] < 0) {
+            sources[f] = column;
+        }
+    }
+}
+
+void dataset_set_sources(Dataset *ds, const int *sources) {
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        ds->columns[f].source = sources[f];
+        ds->columns[f].present = sources[f] >= 0;
+    }
+}
+
+// Parse the County and State of one data line (without its line
+// terminator) into row of ds, names going into table, and remember where
+// the rest of the line starts
+void parse_county_line(const char *line, const char *line_end, Dataset *ds, int row, StringTable *table) {
+    const char *p = line;
+    // A County or State the line lacks (a blank line lacks both) is empty
+    CsvField field = {line_end, line_end, 0};
+    if (p < line_end) {
+        p = csv_next_field(p, line_end, &field);
+    }
+    ds->county_ids[row] = intern_field(table, &field);
+    field = (CsvField){line_end, line_end, 0};
+    if (p < line_end) {
+        p = csv_next_field(p, line_end, &field);
+    }
+    ds->state_ids[row] = intern_field(table, &field);
+    ds->row_fields[row] = p;
+}
+
+// Return the end of the line starting at p (the '\n' or end of buffer)
+const char *find_line_end(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl : end;
+}
+
+// Step over one line; sets *line_end to its end without the terminator
+// and returns the start of the next line
+const char *next_line(const char *p, const char *end, const char **line_end) {
+    const char *e = find_line_end(p, end);
+    const char *next = e < end ? e + 1 : end;
+    if (e > p && e[-1] == '\r') {
+        e--;
+    }
+    *line_end = e;
+    return next;
+}
+
+// Count the lines in [data, end); each one, blank or not, is a row
+int count_data_lines(const char *data, const char *end) {
+    int count = 0;
+    const char *line_end;
+    for (const char *p = data; p < end; p = next_line(p, end, &line_end)) {
+        count++;
+    }
+    return count;
+}
+
+// One line-aligned byte range of the input. Rows are written straight into
+// the dataset starting at first_row; names go into a chunk-local table and
+// are remapped afterwards (chunk 0 uses the dataset's table directly).
+typedef struct {
+    const char *start;
+    const char *end;
+    int first_row;
+    int row_count;
+    StringTable local_names;
+    StringTable *names;
+} ParseChunk;
+
+typedef struct {
+    Dataset *ds;
+    ParseChunk *chunks;
+} ParseJob;
+
+void count_chunk_task(void *arg, int task_index) {
+    ParseChunk *chunk = &((ParseJob *)arg)->chunks[task_index];
+    chunk->row_count = count_data_lines(chunk->start, chunk->end);
+}
+
+// Parse every data line of a chunk. Lines may be of any length; a blank
+// line is a row with an empty County and State and every value 0.
+void parse_chunk_task(void *arg, int task_index) {
+    ParseJob *job = arg;
+    ParseChunk *chunk = &job->chunks[task_index];
+    int row = chunk->first_row;
+    const char *line_end;
+    for (const char *p = chunk->start, *next; p < chunk->end; p = next) {
+        next = next_line(p, chunk->end, &line_end);
+        parse_county_line(p, line_end, job->ds, row, chunk->names);
+        row++;
+    }
+}
+
+// Split [data, end) into line-aligned chunks and parse them into the
+// dataset on the thread pool: count the rows in each chunk, then parse
+// each chunk's names into its slice of the rows. Chunk names are re-interned
+// chunk by chunk in first-seen order, so rows, row order and string ids
+// come out identical to a sequential parse.
+void parse_demographics_parallel(Dataset *ds, const char *data, const char *end) {
+    size_t size = (size_t)(end - data);
+    int thread_count = configured_thread_count();
+    size_t chunk_count = (size_t)thread_count * PARSE_CHUNKS_PER_THREAD;
+    if (chunk_count > size / MIN_PARSE_CHUNK) {
+        chunk_count = size / MIN_PARSE_CHUNK;
+    }
+    if (thread_count == 1 || chunk_count < 1) {
+        chunk_count = 1;
+    }
+
+    // Snap each nominal boundary forward to the start of the next line
+    ParseJob job = {0};
+    job.ds = ds;
+    job.chunks = xcalloc(chunk_count, sizeof(ParseChunk));
+    const char *start = data;
+    for (size_t i = 0; i < chunk_count; i++) {
+        const char *chunk_end = end;
+        if (i + 1 < chunk_count) {
+            const char *nominal = data + size / chunk_count * (i + 1);
+            chunk_end = start;
+            if (nominal > start) {
+                chunk_end = find_line_end(nominal, end);
+                if (chunk_end < end) {
+                    chunk_end++;
+                }
+            }
+        }
+        job.chunks[i].start = start;
+        job.chunks[i].end = chunk_end;
+        job.chunks[i].names = i == 0 ? &ds->names : &job.chunks[i].local_names;
+        start = chunk_end;
+    }
+
+    ThreadPool *pool = get_thread_pool();
+    thread_pool_run(pool, (int)chunk_count, count_chunk_task, &job);
+
+    long long total = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        job.chunks[i].first_row = (int)total;
+        total += job.chunks[i].row_count;
+        if (total > INT32_MAX) {
+            fprintf(stderr, "Error: Too many rows in input\n");
+            exit(1);
+        }
+    }
+
+    dataset_allocate(ds, (int)total);
+    ds->text_end = end;
+    thread_pool_run(pool, (int)chunk_count, parse_chunk_task, &job);
+
+    for (size_t i = 1; i < chunk_count; i++) {
+        ParseChunk *chunk = &job.chunks[i];
+        uint32_t *remap = xmalloc((chunk->local_names.count + 1) * sizeof(uint32_t));
+        for (uint32_t id = 0; id < chunk->local_names.count; id++) {
+            remap[id] = string_table_intern(&ds->names, chunk->local_names.strings[id], chunk->local_names.lengths[id]);
+        }
+        for (int r = chunk->first_row; r < chunk->first_row + chunk->row_count; r++) {
+            ds->county_ids[r] = remap[ds->county_ids[r]];
+            ds->state_ids[r] = remap[ds->state_ids[r]];
+        }
+        free(remap);
+        string_table_free(&chunk->local_names);
+    }
+    free(job.chunks);
+}
+
+// Binary snapshots: a pre-parsed copy of a dataset that can be mapped and
+// queried without parsing. Layout, all in native byte order:
+//
+//   SnapshotHeader
+//   SnapshotBlock directory[block_count]
+//   blocks, each starting on a SNAPSHOT_ALIGN boundary
+//
+// Column blocks hold padded_rows values (or padded_rows / 64 validity
+// words), exactly as the in-memory columns, so they are used in place.
+// They are named by the column's CSV header and hold every column the
+// data had; fields the snapshot lacks read as all invalid.
+// The checksum covers the header (with its checksum field zeroed), the
+// directory and every block.
+
+#define SNAPSHOT_MAGIC "CDSNAP\0\0"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t row_count;
+    uint32_t padded_rows;
+    uint32_t block_count;
+    uint32_t name_count;
+    uint32_t name_slot_count;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t checksum;
+} SnapshotHeader;
+
+typedef enum {
+    BLOCK_COUNTY_IDS = 1,
+    BLOCK_STATE_IDS,
+    BLOCK_NAME_LENGTHS,
+    BLOCK_NAME_OFFSETS,
+    BLOCK_NAME_SLOTS,
+    BLOCK_NAME_DATA,
+    BLOCK_COLUMN_VALUES,
+    BLOCK_COLUMN_VALID,
+    BLOCK_COLUMN_ZONE_MIN,  // optional: rebuilt on load when missing
+    BLOCK_COLUMN_ZONE_MAX
+} SnapshotBlockKind;
+
+typedef struct {
+    char name[112];     // column name for BLOCK_COLUMN_* blocks
+    uint32_t kind;
+    uint32_t type;      // ColumnType of BLOCK_COLUMN_VALUES, ZONE_ROWS of zone blocks
+    uint64_t offset;    // from the start of the file
+    uint64_t length;    // in bytes, without alignment padding
+} SnapshotBlock;
+
+// Streaming 64-bit checksum over little-endian words; input is fed in
+// arbitrary pieces, so a partial word is carried between updates
+typedef struct {
+    uint64_t hash;
+    uint64_t carry;
+    int carry_bytes;
+} Checksum;
+
+static inline uint64_t checksum_mix(uint64_t hash, uint64_t word) {
+    hash ^= word;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0x9E3779B97F4A7C15ULL;
+}
+
+void checksum_update(Checksum *sum, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len && sum->carry_bytes) {
+        sum->carry |= (uint64_t)*p++ << (8 * sum->carry_bytes);
+        len--;
+        if (++sum->carry_bytes == 8) {
+            sum->hash = checksum_mix(sum->hash, sum->carry);
+            sum->carry = 0;
+            sum->carry_bytes = 0;
+        }
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        sum->hash = checksum_mix(sum->hash, word);
+    }
+    while (len--) {
+        sum->carry |= (uint64_t)*p++ << (8 * sum->carry_bytes++);
+    }
+}
+
+uint64_t checksum_final(const Checksum *sum) {
+    return sum->carry_bytes ? checksum_mix(sum->hash, sum->carry ^ ((uint64_t)sum->carry_bytes << 56)) : sum->hash;
+}
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+typedef struct {
+    FILE *file;
+    Checksum sum;
+    uint64_t offset;
+    SnapshotBlock *blocks;
+    int block_count;
+} SnapshotWriter;
+
+// Write one block at the next aligned offset and record it in the directory
+int snapshot_write_block(SnapshotWriter *writer, SnapshotBlockKind kind, const char *name,
+                         uint32_t type, const void *data, size_t length) {
+    static const char zeros[SNAPSHOT_ALIGN] = {0};
+    size_t padding = align_up(writer->offset, SNAPSHOT_ALIGN) - writer->offset;
+    if (padding && fwrite(zeros, 1, padding, writer->file) != padding) {
+        return -1;
+    }
+    checksum_update(&writer->sum, zeros, padding);
+    writer->offset += padding;
+
+    SnapshotBlock *block = &writer->blocks[writer->block_count++];
+    memset(block, 0, sizeof(*block));
+    if (name) {
+        snprintf(block->name, sizeof(block->name), "%s", name);
+    }
+    block->kind = kind;
+    block->type = type;
+    block->offset = writer->offset;
+    block->length = length;
+
+    if (length && fwrite(data, 1, length, writer->file) != length) {
+        return -1;
+    }
+    checksum_update(&writer->sum, data, length);
+    writer->offset += length;
+    return 0;
+}
+
+void require_present_fields(const Dataset *ds);
+
+// Write the loaded dataset, with every column it has, to filename as a
+// snapshot. Returns 0 on success. The file is written under a temporary
+// name and renamed into place, so a snapshot can be replaced while the
+// dataset being written is still mapped from it.
+int write_snapshot(const Dataset *ds, const char *filename) {
+    require_present_fields(ds);
+    char *temporary = xmalloc(strlen(filename) + sizeof(".tmp"));
+    sprintf(temporary, "%s.tmp", filename);
+    FILE *file = fopen(temporary, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not create snapshot %s\n", filename);
+        free(temporary);
+        return -1;
+    }
+
+    const StringTable *names = &ds->names;
+    size_t padded_rows = BITMAP_WORDS(ds->row_count > 0 ? ds->row_count : 1) * 64;
+    int block_count = 6;
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        block_count += ds->columns[f].present ? 4 : 0;
+    }
+    size_t directory_size = (size_t)block_count * sizeof(SnapshotBlock);
+
+    SnapshotWriter writer = {0};
+    writer.file = file;
+    writer.blocks = xcalloc(block_count, sizeof(SnapshotBlock));
+
+    // Header and directory are written last, once offsets and checksum are known
+    writer.offset = sizeof(SnapshotHeader) + directory_size;
+    fseek(file, (long)writer.offset, SEEK_SET);
+
+    // Names are stored NUL-terminated so they can be used in place
+    uint64_t *name_offsets = xmalloc((names->count + 1) * sizeof(uint64_t));
+    uint64_t name_bytes = 0;
+    for (uint32_t id = 0; id < names->count; id++) {
+        name_offsets[id] = name_bytes;
+        name_bytes += names->lengths[id] + 1;
+    }
+    char *name_data = xmalloc(name_bytes ? name_bytes : 1);
+    for (uint32_t id = 0; id < names->count; id++) {
+        memcpy(name_data + name_offsets[id], names->strings[id], names->lengths[id] + 1);
+    }
+
+    int failed = 0;
+    failed |= snapshot_write_block(&writer, BLOCK_COUNTY_IDS, NULL, 0, ds->county_ids, padded_rows * sizeof(uint32_t));
+    failed |= snapshot_write_block(&writer, BLOCK_STATE_IDS, NULL, 0, ds->state_ids, padded_rows * sizeof(uint32_t));
+    failed |= snapshot_write_block(&writer, BLOCK_NAME_LENGTHS, NULL, 0, names->lengths, names->count * sizeof(uint32_t));
+    failed |= snapshot_write_block(&writer, BLOCK_NAME_OFFSETS, NULL, 0, name_offsets, names->count * sizeof(uint64_t));
+    failed |= snapshot_write_block(&writer, BLOCK_NAME_SLOTS, NULL, 0, names->slots, names->slot_count * sizeof(uint32_t));
+    failed |= snapshot_write_block(&writer, BLOCK_NAME_DATA, NULL, 0, name_data, name_bytes);
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (!ds->columns[f].present) {
+            continue;
+        }
+        failed |= snapshot_write_block(&writer, BLOCK_COLUMN_VALUES, field_info[f].header, field_info[f].type,
+                                       ds->columns[f].f, padded_rows * sizeof(float));
+        failed |= snapshot_write_block(&writer, BLOCK_COLUMN_VALID, field_info[f].header, 0,
+                                       ds->columns[f].valid, padded_rows / 64 * sizeof(uint64_t));
+        failed |= snapshot_write_block(&writer, BLOCK_COLUMN_ZONE_MIN, field_info[f].header, ZONE_ROWS,
+                                       ds->columns[f].zone_min.f, zone_count(ds) * sizeof(float));
+        failed |= snapshot_write_block(&writer, BLOCK_COLUMN_ZONE_MAX, field_info[f].header, ZONE_ROWS,
+                                       ds->columns[f].zone_max.f, zone_count(ds) * sizeof(float));
+    }
+    free(name_offsets);
+    free(name_data);
+
+    SnapshotHeader header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.row_count = (uint32_t)ds->row_count;
+    header.padded_rows = (uint32_t)padded_rows;
+    header.block_count = (uint32_t)block_count;
+    header.name_count = names->count;
+    header.name_slot_count = names->slot_count;
+    header.file_size = writer.offset;
+
+    // The checksum combines a sum over the header and directory with one over the blocks
+    Checksum sum = {0};
+    checksum_update(&sum, &header, sizeof(header));
+    checksum_update(&sum, writer.blocks, directory_size);
+    header.checksum = checksum_mix(checksum_final(&sum), checksum_final(&writer.sum));
+
+    fseek(file, 0, SEEK_SET);
+    failed |= fwrite(&header, sizeof(header), 1, file) != 1;
+    failed |= fwrite(writer.blocks, directory_size, 1, file) != 1;
+    failed |= fclose(file) != 0;
+    free(writer.blocks);
+    failed = failed || rename(temporary, filename) != 0;
+    if (failed) {
+        remove(temporary);
+    }
+    free(temporary);
+
+    if (failed) {
+        fprintf(stderr, "Error: Could not write snapshot %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Fields being materialized together. The first parse_count are parsed
+// from the text, in CSV column order; the rest are not in the data.
+typedef struct {
+    Dataset *ds;
+    int fields[MAX_FIELDS];
+    int count;
+    int parse_count;
+} MaterializeJob;
+
+// Compute zone z of field f's zone map from its values and validity bitmap
+void build_zone(const Dataset *ds, int f, size_t z) {
+    const Column *column = &ds->columns[f];
+    size_t words = selection_words(ds);
+    size_t last = (z + 1) * ZONE_WORDS < words ? (z + 1) * ZONE_WORDS : words;
+    if (field_info[f].type == COLUMN_FLOAT) {
+        float min = INFINITY, max = -INFINITY;
+        for (size_t w = z * ZONE_WORDS; w < last; w++) {
+            for (uint64_t bits = column->valid[w]; bits; bits &= bits - 1) {
+                float v = column->f[w * 64 + __builtin_ctzll(bits)];
+                min = v < min ? v : min;
+                max = v > max ? v : max;
+            }
+        }
+        column->zone_min.f[z] = min;
+        column->zone_max.f[z] = max;
+    } else {
+        int32_t min = INT32_MAX, max = INT32_MIN;
+        for (size_t w = z * ZONE_WORDS; w < last; w++) {
+            for (uint64_t bits = column->valid[w]; bits; bits &= bits - 1) {
+                int32_t v = column->i[w * 64 + __builtin_ctzll(bits)];
+                min = v < min ? v : min;
+                max = v > max ? v : max;
+            }
+        }
+        column->zone_min.i[z] = min;
+        column->zone_max.i[z] = max;
+    }
+}
+
+// Compute one column's whole zone map
+void build_zone_map_task(void *arg, int index) {
+    MaterializeJob *job = arg;
+    for (size_t z = 0; z < zone_count(job->ds); z++) {
+        build_zone(job->ds, job->fields[index], z);
+    }
+}
+
+// Build the zone maps of the job's fields, one field per pool task
+void build_zone_maps(MaterializeJob *job) {
+    Dataset *ds = job->ds;
+    for (int k = 0; k < job->count; k++) {
+        Column *column = &ds->columns[job->fields[k]];
+        column->zone_min.f = xmalloc(zone_count(ds) * sizeof(float));
+        column->zone_max.f = xmalloc(zone_count(ds) * sizeof(float));
+        column->zones_owned = 1;
+    }
+    thread_pool_run(get_thread_pool(), job->count, build_zone_map_task, job);
+}
+
+// Parse the job's fields for one morsel of rows, walking each line once
+void materialize_morsel_task(void *arg, int morsel) {
+    MaterializeJob *job = arg;
+    Dataset *ds = job->ds;
+    size_t first, last;
+    morsel_words(ds, morsel, &first, &last);
+    int row_end = last * 64 < (size_t)ds->row_count ? (int)(last * 64) : ds->row_count;
+    long long bytes = 0;
+
+    for (int r = (int)first * 64; r < row_end; r++) {
+        const char *p = ds->row_fields[r];
+        const char *line_end = find_line_end(p, ds->text_end);
+        if (line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+        bytes += line_end - p;
+        CsvField field;
+        int k = 0;
+        for (int column = 2; k < job->parse_count && p < line_end; column++) {
+            p = csv_next_field(p, line_end, &field);
+            int f = job->fields[k];
+            Column *c = &ds->columns[f];
+            if (column != c->source) {
+                continue;
+            }
+            k++;
+            // Empty or unparseable cells read as 0, as atof and atoi give
+            int ok;
+            if (field_info[f].type == COLUMN_FLOAT) {
+                float value = parse_float_field(field.start, field.end, &ok);
+                c->f[r] = value;
+                ok = value >= 0 || field_info[f].is_signed;
+            } else {
+                int value = parse_int_field(field.start, field.end, &ok);
+                c->i[r] = value;
+                ok = value >= 0 || field_info[f].is_signed;
+            }
+            if (ok) {
+                c->valid[r / 64] |= 1ULL << (r & 63);
+            }
+        }
+        // Cells missing from a short line are 0 as well
+        for (; k < job->parse_count; k++) {
+            ds->columns[job->fields[k]].valid[r / 64] |= 1ULL << (r & 63);
+        }
+    }
+    profile_add_bytes(bytes);
+}
+
+// Make sure the given fields (ids below 0 are skipped) of ds are
+// materialized, parsing all the missing ones in one pass over the rows.
+// Returns how many were built. Materializing changes when a column is
+// built, not what the dataset holds, so it goes through a const pointer;
+// the lock keeps queries sharing a dataset from building a column twice.
+int require_fields(const Dataset *shared, const int *fields, int count) {
+    Dataset *ds = (Dataset *)shared;
+    int missing = 0;
+    for (int k = 0; k < count; k++) {
+        if (fields[k] >= 0 && !atomic_load_explicit(&ds->columns[fields[k]].ready, memory_order_acquire)) {
+            missing = 1;
+        }
+    }
+    if (!missing) {
+        return 0;
+    }
+
+    pthread_mutex_lock(ds->column_lock);
+    MaterializeJob job = {0};
+    job.ds = ds;
+    int absent[MAX_FIELDS], absent_count = 0;
+    for (int k = 0; k < count; k++) {
+        int f = fields[k];
+        if (f < 0 || atomic_load(&ds->columns[f].ready)) {
+            continue;
+        }
+        int seen = 0;
+        for (int i = 0; i < job.parse_count; i++) {
+            seen |= job.fields[i] == f;
+        }
+        for (int i = 0; i < absent_count; i++) {
+            seen |= absent[i] == f;
+        }
+        if (seen) {
+            continue;
+        }
+        if (ds->columns[f].source < 0 || !ds->row_fields) {
+            absent[absent_count++] = f;
+            continue;
+        }
+        // Keep the parsed fields in CSV column order
+        int i = job.parse_count++;
+        for (; i > 0 && ds->columns[job.fields[i - 1]].source > ds->columns[f].source; i--) {
+            job.fields[i] = job.fields[i - 1];
+        }
+        job.fields[i] = f;
+    }
+    memcpy(job.fields + job.parse_count, absent, absent_count * sizeof(int));
+    job.count = job.parse_count + absent_count;
+
+    size_t rows = selection_words(ds) * 64;
+    for (int k = 0; k < job.count; k++) {
+        // float and int32_t columns have the same element size
+        Column *column = &ds->columns[job.fields[k]];
+        column->f = xcalloc(rows, sizeof(float));
+        column->valid = xcalloc(rows / 64, sizeof(uint64_t));
+        column->owned = 1;
+    }
+    if (job.parse_count > 0) {
+        run_morsels(ds, materialize_morsel_task, &job);
+    }
+    build_zone_maps(&job);
+    for (int k = 0; k < job.count; k++) {
+        atomic_store_explicit(&ds->columns[job.fields[k]].ready, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(ds->column_lock);
+    return job.count;
+}
+
+// Materialize every column the data has
+void require_present_fields(const Dataset *ds) {
+    int fields[MAX_FIELDS], count = 0;
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (ds->columns[f].present) {
+            fields[count++] = f;
+        }
+    }
+    require_fields(ds, fields, count);
+}
+
+int is_snapshot(const MappedFile *file) {
+    return file->size >= sizeof(SnapshotHeader) && memcmp(file->data, SNAPSHOT_MAGIC, 8) == 0;
+}
+
+// Find a block by kind (and column name, for column blocks)
+const SnapshotBlock *snapshot_find_block(const SnapshotBlock *blocks, uint32_t count, SnapshotBlockKind kind, const char *name) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (blocks[i].kind == kind && (!name || strcmp(blocks[i].name, name) == 0)) {
+            return &blocks[i];
+        }
+    }
+    return NULL;
+}
+
+// Field of a snapshot's BLOCK_COLUMN_VALUES block, registering the column
+// if it is new; -1 if it cannot be used. Columns are matched by header, or
+// by field name in snapshots written before fields came from the header.
+int snapshot_column_field(const SnapshotBlock *block) {
+    if (memchr(block->name, '\0', sizeof(block->name)) == NULL) {
+        return -1;
+    }
+    int f = find_field_by_header(block->name);
+    if (f < 0) {
+        f = find_field(block->name);
+    }
+    if (f < 0 && (block->type == COLUMN_FLOAT || block->type == COLUMN_INT)) {
+        f = register_field(block->name, (ColumnType)block->type);
+    }
+    return f;
+}
+
+// Register the columns of a data file, CSV or snapshot, so operations on
+// them can be compiled before it is loaded. Errors are left to the load.
+// A pipe can be read only once, so only regular files are looked at.
+void register_file_fields(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return;
+    }
+    SnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, SNAPSHOT_MAGIC, 8) == 0) {
+        SnapshotBlock block;
+        for (uint32_t i = 0; i < header.block_count && fread(&block, sizeof(block), 1, file) == 1; i++) {
+            if (block.kind == BLOCK_COLUMN_VALUES) {
+                snapshot_column_field(&block);
+            }
+        }
+    } else {
+        rewind(file);
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length = getline(&line, &capacity, file);
+        if (length > 0) {
+            int sources[MAX_FIELDS];
+            read_header(line, line + strcspn(line, "\n"), sources);
+        }
+        free(line);
+    }
+    fclose(file);
+}
+
+// Register the columns of a data file already read into memory, as
+// register_file_fields does for one on disk
+void register_text_fields(const char *data, size_t size) {
+    if (size >= sizeof(SnapshotHeader) && memcmp(data, SNAPSHOT_MAGIC, 8) == 0) {
+        const SnapshotHeader *header = (const SnapshotHeader *)data;
+        const SnapshotBlock *blocks = (const SnapshotBlock *)(data + sizeof(SnapshotHeader));
+        size_t available = (size - sizeof(SnapshotHeader)) / sizeof(SnapshotBlock);
+        for (uint32_t i = 0; i < header->block_count && i < available; i++) {
+            if (blocks[i].kind == BLOCK_COLUMN_VALUES) {
+                snapshot_column_field(&blocks[i]);
+            }
+        }
+    } else {
+        int sources[MAX_FIELDS];
+        read_header(data, find_line_end(data, data + size), sources);
+    }
+}
+
+// Inputs other than regular files (pipes, /dev/stdin) can be read only
+// once, and their columns must be known before operations are compiled.
+// Such an input is read whole into *input now, its columns registered,
+// and 1 returned; the dataset is then loaded from *input. Regular files
+// are left to register_file_fields and to load_dataset.
+int preread_input(const char *filename, MappedFile *input) {
+    struct stat st;
+    if (stat(filename, &st) != 0 || S_ISREG(st.st_mode) || map_file(filename, input, 1) != 0) {
+        register_file_fields(filename);
+        return 0;
+    }
+    register_text_fields(input->data, input->size);
+    return 1;
+}
+
+// preread_input for --stream, which never holds the whole input: a
+// non-regular input is opened and read only up to the end of its header
+// line. Returns the open descriptor, with what was read in *head, or -1
+// (having registered a regular file's columns) if the input is to be
+// opened by stream_operations.
+int preread_stream_input(const char *filename, char **head, size_t *head_length) {
+    *head = NULL;
+    *head_length = 0;
+    struct stat st;
+    int fd = stat(filename, &st) != 0 || S_ISREG(st.st_mode) ? -1 : open(filename, O_RDONLY);
+    if (fd < 0) {
+        register_file_fields(filename);
+        return -1;
+    }
+    size_t capacity = 64 * 1024, length = 0;
+    char *buffer = xmalloc(capacity);
+    ssize_t n;
+    while (find_line_end(buffer, buffer + length) == buffer + length &&
+           (n = read(fd, buffer + length, capacity - length)) > 0) {
+        length += (size_t)n;
+        if (length == capacity) {
+            capacity *= 2;
+            buffer = xrealloc(buffer, capacity);
+        }
+    }
+    register_text_fields(buffer, length);
+    *head = buffer;
+    *head_length = length;
+    return fd;
+}
+
+// A block load_snapshot needs, its expected size and where to store its address
+typedef struct {
+    SnapshotBlockKind kind;
+    const char *name;
+    size_t length;
+    const void **target;
+} SnapshotBlockRef;
+
+// Point ds at the arrays inside a mapped snapshot after validating it.
+// On success the dataset takes ownership of the mapping.
+int load_snapshot(MappedFile *file, Dataset *ds, const char *filename) {
+    const SnapshotHeader *header = (const SnapshotHeader *)file->data;
+    if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Error: Unsupported snapshot version in %s\n", filename);
+        return -1;
+    }
+    size_t directory_size = (size_t)header->block_count * sizeof(SnapshotBlock);
+    // Name lookups probe until they reach an empty slot, so the slot count
+    // must be a power of two larger than the number of names
+    uint32_t slot_count = header->name_slot_count;
+    if (header->file_size != file->size || sizeof(SnapshotHeader) + directory_size > file->size ||
+        header->padded_rows != BITMAP_WORDS(header->row_count > 0 ? header->row_count : 1) * 64 ||
+        slot_count == 0 || (slot_count & (slot_count - 1)) || header->name_count >= slot_count) {
+        fprintf(stderr, "Error: Snapshot %s is truncated or malformed\n", filename);
+        return -1;
+    }
+
+    const SnapshotBlock *blocks = (const SnapshotBlock *)(file->data + sizeof(SnapshotHeader));
+    SnapshotHeader unsummed = *header;
+    unsummed.checksum = 0;
+    Checksum directory_sum = {0}, block_sum = {0};
+    checksum_update(&directory_sum, &unsummed, sizeof(unsummed));
+    checksum_update(&directory_sum, blocks, directory_size);
+    checksum_update(&block_sum, file->data + sizeof(SnapshotHeader) + directory_size,
+                    file->size - sizeof(SnapshotHeader) - directory_size);
+    if (checksum_mix(checksum_final(&directory_sum), checksum_final(&block_sum)) != header->checksum) {
+        fprintf(stderr, "Error: Snapshot %s failed its checksum\n", filename);
+        return -1;
+    }
+
+    // Look up every block we need and check it lies inside the file
+    size_t rows = header->padded_rows;
+    const void *county_ids, *state_ids, *lengths, *offsets, *slots, *data;
+    const void *values[MAX_FIELDS] = {0}, *valid[MAX_FIELDS] = {0};
+    SnapshotBlockRef wanted[6 + 2 * MAX_FIELDS] = {
+        {BLOCK_COUNTY_IDS, NULL, rows * sizeof(uint32_t), &county_ids},
+        {BLOCK_STATE_IDS, NULL, rows * sizeof(uint32_t), &state_ids},
+        {BLOCK_NAME_LENGTHS, NULL, header->name_count * sizeof(uint32_t), &lengths},
+        {BLOCK_NAME_OFFSETS, NULL, header->name_count * sizeof(uint64_t), &offsets},
+        {BLOCK_NAME_SLOTS, NULL, header->name_slot_count * sizeof(uint32_t), &slots},
+        {BLOCK_NAME_DATA, NULL, 0, &data}
+    };
+    int wanted_count = 6;
+
+    for (uint32_t i = 0; i < header->block_count; i++) {
+        const SnapshotBlock *block = &blocks[i];
+        if (block->kind != BLOCK_COLUMN_VALUES) {
+            continue;
+        }
+        int f = snapshot_column_field(block);
+        if (f >= 0 && block->type != (uint32_t)field_info[f].type) {
+            fprintf(stderr, "Error: Snapshot %s has the wrong type for %s\n", filename, block->name);
+            return -1;
+        }
+        if (f < 0 || values[f]) {
+            continue;
+        }
+        wanted[wanted_count++] = (SnapshotBlockRef){BLOCK_COLUMN_VALUES, block->name, rows * sizeof(float), &values[f]};
+        wanted[wanted_count++] = (SnapshotBlockRef){BLOCK_COLUMN_VALID, block->name, rows / 64 * sizeof(uint64_t), &valid[f]};
+        values[f] = block;  // claimed; replaced by the data address below
+    }
+
+    size_t name_data_length = 0;
+    for (int i = 0; i < wanted_count; i++) {
+        const SnapshotBlock *block = snapshot_find_block(blocks, header->block_count, wanted[i].kind, wanted[i].name);
+        if (!block || block->offset % SNAPSHOT_ALIGN || block->offset > file->size ||
+            block->length > file->size - block->offset ||
+            (wanted[i].kind != BLOCK_NAME_DATA && block->length != wanted[i].length)) {
+            fprintf(stderr, "Error: Snapshot %s is missing %s data\n", filename, wanted[i].name ? wanted[i].name : "table");
+            return -1;
+        }
+        if (block->kind == BLOCK_NAME_DATA) {
+            name_data_length = block->length;
+        }
+        *wanted[i].target = file->data + block->offset;
+    }
+
+    // The name table is used in place except for the id -> pointer array
+    memset(ds, 0, sizeof(*ds));
+    ds->row_count = (int)header->row_count;
+    ds->county_ids = (uint32_t *)county_ids;
+    ds->state_ids = (uint32_t *)state_ids;
+    ds->names.count = ds->names.capacity = header->name_count;
+    ds->names.lengths = (uint32_t *)lengths;
+    ds->names.slots = (uint32_t *)slots;
+    ds->names.slot_count = header->name_slot_count;
+    ds->names.strings = xmalloc((header->name_count + 1) * sizeof(char *));
+    const uint64_t *name_offsets = offsets;
+    int malformed = 0;
+    for (uint32_t id = 0; id < header->name_count && !malformed; id++) {
+        // Each name and its terminator lie inside the name data
+        uint64_t offset = name_offsets[id];
+        malformed = offset >= name_data_length || ds->names.lengths[id] >= name_data_length - offset ||
+                    ((const char *)data)[offset + ds->names.lengths[id]] != '\0';
+        ds->names.strings[id] = (const char *)data + offset;
+    }
+    for (uint32_t slot = 0; slot < slot_count && !malformed; slot++) {
+        malformed = ds->names.slots[slot] > header->name_count;
+    }
+    for (uint32_t r = 0; r < header->row_count && !malformed; r++) {
+        malformed = ds->county_ids[r] >= header->name_count || ds->state_ids[r] >= header->name_count;
+    }
+    if (malformed) {
+        fprintf(stderr, "Error: Snapshot %s is truncated or malformed\n", filename);
+        free(ds->names.strings);
+        memset(ds, 0, sizeof(*ds));
+        return -1;
+    }
+
+    // Use the stored zone maps if they match this build's zone size
+    dataset_init_columns(ds);
+    MaterializeJob job = {0};
+    job.ds = ds;
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (!values[f]) {
+            continue;
+        }
+        Column *column = &ds->columns[f];
+        column->f = (float *)values[f];
+        column->valid = (uint64_t *)valid[f];
+        column->present = 1;
+
+        size_t length = zone_count(ds) * sizeof(float);
+        const SnapshotBlock *min = snapshot_find_block(blocks, header->block_count, BLOCK_COLUMN_ZONE_MIN, field_info[f].header);
+        const SnapshotBlock *max = snapshot_find_block(blocks, header->block_count, BLOCK_COLUMN_ZONE_MAX, field_info[f].header);
+        if (!min || !max) {
+            min = snapshot_find_block(blocks, header->block_count, BLOCK_COLUMN_ZONE_MIN, field_info[f].name);
+            max = snapshot_find_block(blocks, header->block_count, BLOCK_COLUMN_ZONE_MAX, field_info[f].name);
+        }
+        if (min && max && min->type == ZONE_ROWS && max->type == ZONE_ROWS &&
+            min->length == length && max->length == length &&
+            min->offset % SNAPSHOT_ALIGN == 0 && max->offset % SNAPSHOT_ALIGN == 0 &&
+            min->offset <= file->size - length && max->offset <= file->size - length) {
+            column->zone_min.f = (float *)(file->data + min->offset);
+            column->zone_max.f = (float *)(file->data + max->offset);
+        } else {
+            job.fields[job.count++] = f;
+        }
+    }
+    build_zone_maps(&job);
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (values[f]) {
+            atomic_store(&ds->columns[f].ready, 1);
+        }
+    }
+    ds->snapshot_data = file->data;
+    ds->snapshot_size = file->size;
+    ds->snapshot_mapped = file->mapped;
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    uint32_t id;
+} StateName;
+
+int compare_state_names(const void *a, const void *b) {
+    return strcmp(((const StateName *)a)->name, ((const StateName *)b)->name);
+}
+
+// Build ds->states from the State column with one counting-sort pass
+void build_state_index(Dataset *ds) {
+    StateIndex *index = &ds->states;
+    uint32_t name_count = ds->names.count;
+    index->code_by_name = xmalloc((name_count > 0 ? name_count : 1) * sizeof(uint32_t));
+    for (uint32_t id = 0; id < name_count; id++) {
+        index->code_by_name[id] = STATE_NONE;
+    }
+
+    // Find the distinct states and number them alphabetically
+    int capacity = 64;
+    StateName *states = xmalloc(capacity * sizeof(StateName));
+    index->count = 0;
+    for (int r = 0; r < ds->row_count; r++) {
+        uint32_t id = ds->state_ids[r];
+        if (index->code_by_name[id] == STATE_NONE) {
+            if (index->count == capacity) {
+                capacity *= 2;
+                states = xrealloc(states, capacity * sizeof(StateName));
+            }
+            index->code_by_name[id] = 0;
+            states[index->count++] = (StateName){string_table_get(&ds->names, id), id};
+        }
+    }
+    qsort(states, index->count, sizeof(StateName), compare_state_names);
+    index->name_ids = xmalloc((index->count > 0 ? index->count : 1) * sizeof(uint32_t));
+    for (int c = 0; c < index->count; c++) {
+        index->name_ids[c] = states[c].id;
+        index->code_by_name[states[c].id] = (uint32_t)c;
+    }
+    free(states);
+
+    // Encode the column and bucket the rows by state
+    index->codes = xmalloc((ds->row_count > 0 ? ds->row_count : 1) * sizeof(uint32_t));
+    index->row_offsets = xcalloc(index->count + 1, sizeof(int));
+    index->rows = xmalloc((ds->row_count > 0 ? ds->row_count : 1) * sizeof(int));
+    for (int r = 0; r < ds->row_count; r++) {
+        index->codes[r] = index->code_by_name[ds->state_ids[r]];
+        index->row_offsets[index->codes[r] + 1]++;
+    }
+    for (int c = 0; c < index->count; c++) {
+        index->row_offsets[c + 1] += index->row_offsets[c];
+    }
+    int *next = xmalloc((index->count > 0 ? index->count : 1) * sizeof(int));
+    memcpy(next, index->row_offsets, index->count * sizeof(int));
+    for (int r = 0; r < ds->row_count; r++) {
+        index->rows[next[index->codes[r]]++] = r;
+    }
+    free(next);
+}
+
+// Code of the state named name, or STATE_NONE if no row has it
+uint32_t find_state(const Dataset *ds, const char *name) {
+    uint32_t id = string_table_find(&ds->names, name, strlen(name));
+    return id == STRING_NOT_FOUND ? STATE_NONE : ds->states.code_by_name[id];
+}
+
+// Release everything a dataset owns (or its snapshot mapping)
+void dataset_free(Dataset *ds) {
+    free(ds->states.name_ids);
+    free(ds->states.code_by_name);
+    free(ds->states.codes);
+    free(ds->states.row_offsets);
+    free(ds->states.rows);
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        Column *column = &ds->columns[f];
+        if (column->zones_owned) {
+            free(column->zone_min.f);
+            free(column->zone_max.f);
+        }
+        if (column->owned) {
+            free(column->f);
+            free(column->valid);
+        }
+    }
+    if (ds->column_lock) {
+        pthread_mutex_destroy(ds->column_lock);
+        free(ds->column_lock);
+    }
+    free(ds->row_lines);
+    free(ds->keys.keys);
+    free(ds->keys.rows);
+    free(ds->row_fields);
+    if (ds->text_data) {
+        MappedFile file = {ds->text_data, ds->text_size, ds->text_mapped};
+        unmap_file(&file);
+    }
+    if (ds->snapshot_data) {
+        MappedFile file = {ds->snapshot_data, ds->snapshot_size, ds->snapshot_mapped};
+        unmap_file(&file);
+        free(ds->names.strings);
+    } else {
+        free(ds->county_ids);
+        free(ds->state_ids);
+        string_table_free(&ds->names);
+    }
+    memset(ds, 0, sizeof(*ds));
+}
+
+// A usable dataset with no rows
+void dataset_init_empty(Dataset *ds) {
+    dataset_allocate(ds, 0);
+    build_state_index(ds);
+}
+
+// Load a CSV file or a snapshot already in memory into ds, which must be
+// empty; ds takes over file. Returns 0 on success; on failure ds is left
+// empty and file is released.
+int load_mapped_dataset(Dataset *ds, MappedFile file, const char *filename) {
+    if (file.size == 0) {
+        fprintf(stderr, "Error: File is empty or malformed\n");
+        unmap_file(&file);
+        return -1;
+    }
+    profile_add_bytes((long long)file.size);
+
+    if (is_snapshot(&file)) {
+        // The columns stay mapped for as long as the dataset is in use
+        if (load_snapshot(&file, ds, filename) != 0) {
+            unmap_file(&file);
+            return -1;
+        }
+        build_state_index(ds);
+        return 0;
+    }
+
+    // The header gives the columns
+    const char *end = file.data + file.size;
+    const char *header_end = find_line_end(file.data, end);
+    int sources[MAX_FIELDS];
+    read_header(file.data, header_end, sources);
+
+    // Read and process each subsequent line. The text stays mapped for the
+    // columns still to be materialized.
+    const char *body = header_end < end ? header_end + 1 : end;
+    parse_demographics_parallel(ds, body, end);
+    dataset_set_sources(ds, sources);
+    build_state_index(ds);
+    ds->text_data = file.data;
+    ds->text_size = file.size;
+    ds->text_mapped = file.mapped;
+    return 0;
+}
+
+// Load a CSV file or a snapshot written by --convert into ds, which must be
+// empty. With copy the file is read into memory rather than mapped (see
+// MappedFile). Returns 0 on success; on failure ds is left empty.
+int load_dataset(Dataset *ds, const char *filename, int copy) {
+    MappedFile file;
+    if (map_file(filename, &file, copy) != 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+    return load_mapped_dataset(ds, file, filename);
+}
+
+// load_dataset, reporting how many rows were loaded. input, if not NULL,
+// is the file as preread_input read it, which ds takes over.
+int parse_demographics_file(Dataset *ds, const char *filename, const MappedFile *input, int copy) {
+    if ((input ? load_mapped_dataset(ds, *input, filename) : load_dataset(ds, filename, copy)) != 0) {
+        return -1;
+    }
+    printf("%d entries loaded successfully.\n", ds->row_count);
+    return 0;
+}
+
+// Upserts: applying rows keyed by (County, State) to a loaded dataset
+// without parsing it again. A row whose key the dataset already has
+// replaces that row's values, for the columns the new row carries; any
+// other row is appended. Rows are never removed.
+
+static inline uint64_t row_key(const Dataset *ds, int row) {
+    return (uint64_t)ds->county_ids[row] << 32 | ds->state_ids[row];
+}
+
+// Slot of key, or of the empty slot where it belongs
+size_t row_key_slot(const RowKeyIndex *index, uint64_t key) {
+    uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+    size_t slot = (size_t)(hash ^ (hash >> 29)) & (index->slot_count - 1);
+    while (index->rows[slot] >= 0 && index->keys[slot] != key) {
+        slot = (slot + 1) & (index->slot_count - 1);
+    }
+    return slot;
+}
+
+// Row with key, or -1
+int row_key_find(const RowKeyIndex *index, uint64_t key) {
+    return index->slot_count ? index->rows[row_key_slot(index, key)] : -1;
+}
+
+void row_key_set(RowKeyIndex *index, uint64_t key, int row) {
+    // Keep the load factor under one half
+    if ((index->used + 1) * 2 > index->slot_count) {
+        RowKeyIndex grown = {0};
+        grown.slot_count = index->slot_count ? index->slot_count * 2 : ROW_KEY_INITIAL_SLOTS;
+        grown.keys = xmalloc(grown.slot_count * sizeof(uint64_t));
+        grown.rows = xmalloc(grown.slot_count * sizeof(int));
+        memset(grown.rows, 0xff, grown.slot_count * sizeof(int));
+        for (size_t slot = 0; slot < index->slot_count; slot++) {
+            if (index->rows[slot] >= 0) {
+                size_t to = row_key_slot(&grown, index->keys[slot]);
+                grown.keys[to] = index->keys[slot];
+                grown.rows[to] = index->rows[slot];
+            }
+        }
+        grown.used = index->used;
+        free(index->keys);
+        free(index->rows);
+        *index = grown;
+    }
+    size_t slot = row_key_slot(index, key);
+    index->used += index->rows[slot] < 0;
+    index->keys[slot] = key;
+    index->rows[slot] = row;
+}
+
+// Give out, which holds base's rows followed by new ones with states base
+// already has, base's state index extended with the new rows. A new state
+// would renumber the codes, so then the index is built from scratch.
+void extend_state_index(Dataset *out, const Dataset *base) {
+    const StateIndex *old = &base->states;
+    for (int r = base->row_count; r < out->row_count; r++) {
+        uint32_t id = out->state_ids[r];
+        if (id >= base->names.count || old->code_by_name[id] == STATE_NONE) {
+            build_state_index(out);
+            return;
+        }
+    }
+
+    StateIndex *index = &out->states;
+    uint32_t name_count = out->names.count;
+    index->count = old->count;
+    index->name_ids = xmalloc((old->count > 0 ? old->count : 1) * sizeof(uint32_t));
+    memcpy(index->name_ids, old->name_ids, old->count * sizeof(uint32_t));
+    index->code_by_name = xmalloc((name_count > 0 ? name_count : 1) * sizeof(uint32_t));
+    memcpy(index->code_by_name, old->code_by_name, base->names.count * sizeof(uint32_t));
+    for (uint32_t id = base->names.count; id < name_count; id++) {
+        index->code_by_name[id] = STATE_NONE;
+    }
+
+    // Each state's new rows go after its old ones
+    index->codes = xmalloc((out->row_count > 0 ? out->row_count : 1) * sizeof(uint32_t));
+    memcpy(index->codes, old->codes, base->row_count * sizeof(uint32_t));
+    index->row_offsets = xcalloc(index->count + 1, sizeof(int));
+    for (int r = base->row_count; r < out->row_count; r++) {
+        index->codes[r] = index->code_by_name[out->state_ids[r]];
+        index->row_offsets[index->codes[r] + 1]++;
+    }
+    for (int c = 0; c < index->count; c++) {
+        index->row_offsets[c + 1] += index->row_offsets[c] + old->row_offsets[c + 1] - old->row_offsets[c];
+    }
+    index->rows = xmalloc((out->row_count > 0 ? out->row_count : 1) * sizeof(int));
+    int *next = xmalloc((index->count > 0 ? index->count : 1) * sizeof(int));
+    for (int c = 0; c < index->count; c++) {
+        int old_rows = old->row_offsets[c + 1] - old->row_offsets[c];
+        memcpy(index->rows + index->row_offsets[c], old->rows + old->row_offsets[c], old_rows * sizeof(int));
+        next[c] = index->row_offsets[c] + old_rows;
+    }
+    for (int r = base->row_count; r < out->row_count; r++) {
+        index->rows[next[index->codes[r]]++] = r;
+    }
+    free(next);
+}
+
+typedef struct {
+    int updated;    // rows that replaced a row with the same key
+    int added;
+} UpsertCounts;
+
+// Build out from base with the rows of each update applied in order.
+// out carries only the given fields (ids below 0 are skipped; NULL means
+// every field the data has), which are all that get materialized in base
+// and the updates. base's columns are copied rather than parsed again,
+// and its zone maps and state index are carried over, recomputing only
+// the zones the updates touch; the state index is extended when rows are
+// only added under known states and rebuilt otherwise. out takes over
+// base's key index; nothing else of base changes, so queries may keep
+// using it meanwhile.
+void dataset_upsert(Dataset *out, Dataset *base, Dataset *const *updates, int update_count,
+                    const int *fields, int field_count, UpsertCounts *counts) {
+    int carried[MAX_FIELDS] = {0};
+    for (int k = 0; k < field_count; k++) {
+        if (fields[k] >= 0) {
+            carried[fields[k]] = 1;
+        }
+    }
+    if (fields) {
+        require_fields(base, fields, field_count);
+        for (int u = 0; u < update_count; u++) {
+            require_fields(updates[u], fields, field_count);
+        }
+    } else {
+        require_present_fields(base);
+        for (int u = 0; u < update_count; u++) {
+            require_present_fields(updates[u]);
+        }
+    }
+    if (!base->keys.rows) {
+        for (int r = 0; r < base->row_count; r++) {
+            row_key_set(&base->keys, row_key(base, r), r);
+        }
+    }
+    memset(out, 0, sizeof(*out));
+    for (uint32_t id = 0; id < base->names.count; id++) {
+        string_table_intern(&out->names, base->names.strings[id], base->names.lengths[id]);
+    }
+    out->keys = base->keys;
+    memset(&base->keys, 0, sizeof(base->keys));
+    counts->updated = counts->added = 0;
+
+    // Find the row each update row goes to, appending rows for new keys
+    long long row_count = base->row_count;
+    uint64_t **keys = xmalloc((update_count > 0 ? update_count : 1) * sizeof(uint64_t *));
+    int **targets = xmalloc((update_count > 0 ? update_count : 1) * sizeof(int *));
+    for (int u = 0; u < update_count; u++) {
+        const Dataset *update = updates[u];
+        keys[u] = xmalloc((update->row_count > 0 ? update->row_count : 1) * sizeof(uint64_t));
+        targets[u] = xmalloc((update->row_count > 0 ? update->row_count : 1) * sizeof(int));
+        for (int r = 0; r < update->row_count; r++) {
+            uint32_t county = update->county_ids[r], state = update->state_ids[r];
+            county = string_table_intern(&out->names, update->names.strings[county], update->names.lengths[county]);
+            state = string_table_intern(&out->names, update->names.strings[state], update->names.lengths[state]);
+            uint64_t key = (uint64_t)county << 32 | state;
+            int row = row_key_find(&out->keys, key);
+            if (row >= 0) {
+                counts->updated++;
+            } else {
+                if (row_count == INT32_MAX) {
+                    fprintf(stderr, "Error: Too many rows in input\n");
+                    exit(1);
+                }
+                row = (int)row_count++;
+                row_key_set(&out->keys, key, row);
+                counts->added++;
+            }
+            keys[u][r] = key;
+            targets[u][r] = row;
+        }
+    }
+
+    dataset_allocate(out, (int)row_count);
+    free(out->row_fields);
+    out->row_fields = NULL;
+    size_t rows = selection_words(out) * 64;
+    memcpy(out->county_ids, base->county_ids, base->row_count * sizeof(uint32_t));
+    memcpy(out->state_ids, base->state_ids, base->row_count * sizeof(uint32_t));
+    out->row_lines = xmalloc(rows * sizeof(int));
+    for (int r = 0; r < base->row_count; r++) {
+        out->row_lines[r] = line_of_row(base, r);
+    }
+    size_t zones = zone_count(out), base_zones = zone_count(base);
+    uint64_t *touched = xcalloc(BITMAP_WORDS(zones), sizeof(uint64_t));
+    for (int u = 0; u < update_count; u++) {
+        for (int r = 0; r < updates[u]->row_count; r++) {
+            int row = targets[u][r];
+            out->county_ids[row] = (uint32_t)(keys[u][r] >> 32);
+            out->state_ids[row] = (uint32_t)keys[u][r];
+            out->row_lines[row] = line_of_row(updates[u], r);
+            touched[row / ZONE_ROWS / 64] |= 1ULL << (row / ZONE_ROWS & 63);
+        }
+    }
+
+    // Columns are copied whole (their values as raw 32-bit words), then
+    // the update rows written over them
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        const Column *from = &base->columns[f];
+        Column *to = &out->columns[f];
+        to->present = from->present;
+        for (int u = 0; u < update_count; u++) {
+            to->present |= updates[u]->columns[f].present;
+        }
+        to->present = to->present && (!fields || carried[f]);
+        if (!to->present) {
+            continue;
+        }
+        to->f = xcalloc(rows, sizeof(float));
+        to->valid = xcalloc(rows / 64, sizeof(uint64_t));
+        to->zone_min.f = xmalloc(zones * sizeof(float));
+        to->zone_max.f = xmalloc(zones * sizeof(float));
+        to->owned = to->zones_owned = 1;
+        if (from->present) {
+            memcpy(to->i, from->i, base->row_count * sizeof(int32_t));
+            memcpy(to->valid, from->valid, selection_words(base) * sizeof(uint64_t));
+            memcpy(to->zone_min.f, from->zone_min.f, base_zones * sizeof(float));
+            memcpy(to->zone_max.f, from->zone_max.f, base_zones * sizeof(float));
+        }
+        for (int u = 0; u < update_count; u++) {
+            const Column *column = &updates[u]->columns[f];
+            if (!column->present) {
+                continue;
+            }
+            for (int r = 0; r < updates[u]->row_count; r++) {
+                int row = targets[u][r];
+                to->i[row] = column->i[r];
+                uint64_t bit = 1ULL << (row & 63);
+                to->valid[row / 64] = bitmap_test(column->valid, r) ? to->valid[row / 64] | bit : to->valid[row / 64] & ~bit;
+            }
+        }
+        for (size_t z = 0; z < zones; z++) {
+            if (!from->present || z >= base_zones || bitmap_test(touched, (int)z)) {
+                build_zone(out, f, z);
+            }
+        }
+        atomic_store(&to->ready, 1);
+    }
+    extend_state_index(out, base);
+
+    for (int u = 0; u < update_count; u++) {
+        free(keys[u]);
+        free(targets[u]);
+    }
+    free(keys);
+    free(targets);
+    free(touched);
+}
+
+// Apply the rows of filename (a CSV file or snapshot, or input as
+// preread_input read it) to ds as upserts, keeping the given fields (NULL
+// for all of them) as dataset_upsert does
+int upsert_file(Dataset *ds, const char *filename, const MappedFile *input, const int *fields, int field_count) {
+    ProfileMark mark = profile_begin();
+    Dataset updates = {0};
+    if ((input ? load_mapped_dataset(&updates, *input, filename) : load_dataset(&updates, filename, 0)) != 0) {
+        return -1;
+    }
+    Dataset merged;
+    Dataset *list[] = {&updates};
+    UpsertCounts counts;
+    dataset_upsert(&merged, ds, list, 1, fields, field_count, &counts);
+    profile_end(&mark, "upsert", updates.row_count, merged.row_count);
+    dataset_free(&updates);
+    dataset_free(ds);
+    *ds = merged;
+    printf("%d entries updated and %d added from %s.\n", counts.updated, counts.added, filename);
+    return 0;
+}
+
+
+// Scan kernels. Every kernel works on one 64-row word of a column at a
+// time: compare kernels return a bitmask of the rows that match, sum
+// kernels add up the rows whose bit is set in a mask. There are scalar,
+// SSE2 and AVX2 versions; select_kernels picks one set at startup.
+
+typedef uint64_t (*CompareWordFn)(const void *values, float threshold);
+
+typedef struct {
+    const char *name;
+    CompareWordFn compare_float_ge;
+    CompareWordFn compare_float_le;
+    CompareWordFn compare_int_ge;  // integer kernels compare against (int)threshold
+    CompareWordFn compare_int_le;
+    int64_t (*sum_int)(const int32_t *values, uint64_t mask);
+    // sum of (long long)((percentage / 100) * population), as population_field computes it
+    int64_t (*sum_sub_population)(const float *percentages, const int32_t *populations, uint64_t mask);
+} KernelSet;
+
+uint64_t compare_float_ge_scalar(const void *values, float threshold) {
+    const float *v = values;
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i++) {
+        bits |= (uint64_t)(v[i] >= threshold) << i;
+    }
+    return bits;
+}
+
+uint64_t compare_float_le_scalar(const void *values, float threshold) {
+    const float *v = values;
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i++) {
+        bits |= (uint64_t)(v[i] <= threshold) << i;
+    }
+    return bits;
+}
+
+uint64_t compare_int_ge_scalar(const void *values, float threshold) {
+    const int32_t *v = values;
+    int t = (int)threshold;
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i++) {
+        bits |= (uint64_t)(v[i] >= t) << i;
+    }
+    return bits;
+}
+
+uint64_t compare_int_le_scalar(const void *values, float threshold) {
+    const int32_t *v = values;
+    int t = (int)threshold;
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i++) {
+        bits |= (uint64_t)(v[i] <= t) << i;
+    }
+    return bits;
+}
+
+// Comparison other than ge/le: nothing matches
+uint64_t compare_none(const void *values, float threshold) {
+    (void)values;
+    (void)threshold;
+    return 0;
+}
+
+int64_t sum_int_scalar(const int32_t *values, uint64_t mask) {
+    int64_t total = 0;
+    while (mask) {
+        total += values[__builtin_ctzll(mask)];
+        mask &= mask - 1;
+    }
+    return total;
+}
+
+int64_t sum_sub_population_scalar(const float *percentages, const int32_t *populations, uint64_t mask) {
+    int64_t total = 0;
+    while (mask) {
+        int i = __builtin_ctzll(mask);
+        total += (long long)((percentages[i] / 100) * populations[i]);
+        mask &= mask - 1;
+    }
+    return total;
+}
+
+static const KernelSet scalar_kernels = {
+    "scalar",
+    compare_float_ge_scalar, compare_float_le_scalar,
+    compare_int_ge_scalar, compare_int_le_scalar,
+    sum_int_scalar, sum_sub_population_scalar
+};
+
+#ifdef HAVE_X86_KERNELS
+
+uint64_t compare_float_ge_sse(const void *values, float threshold) {
+    const float *v = values;
+    __m128 t = _mm_set1_ps(threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 4) {
+        bits |= (uint64_t)_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(v + i), t)) << i;
+    }
+    return bits;
+}
+
+uint64_t compare_float_le_sse(const void *values, float threshold) {
+    const float *v = values;
+    __m128 t = _mm_set1_ps(threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 4) {
+        bits |= (uint64_t)_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(v + i), t)) << i;
+    }
+    return bits;
+}
+
+// v >= t is !(t > v); the inverted bits are masked back to the lanes compared
+uint64_t compare_int_ge_sse(const void *values, float threshold) {
+    const int32_t *v = values;
+    __m128i t = _mm_set1_epi32((int)threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 4) {
+        __m128i gt = _mm_cmpgt_epi32(t, _mm_loadu_si128((const __m128i *)(v + i)));
+        bits |= (uint64_t)(~_mm_movemask_ps(_mm_castsi128_ps(gt)) & 0xf) << i;
+    }
+    return bits;
+}
+
+uint64_t compare_int_le_sse(const void *values, float threshold) {
+    const int32_t *v = values;
+    __m128i t = _mm_set1_epi32((int)threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 4) {
+        __m128i gt = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(v + i)), t);
+        bits |= (uint64_t)(~_mm_movemask_ps(_mm_castsi128_ps(gt)) & 0xf) << i;
+    }
+    return bits;
+}
+
+// Lane mask with all bits set in lane i when bit i of mask4 is set
+static inline __m128i lane_mask_sse(unsigned mask4) {
+    const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)mask4), lane_bits), lane_bits);
+}
+
+// Widen four int32 lanes to int64 and add them to two int64 accumulators
+static inline __m128i add_widened_sse(__m128i acc, __m128i v) {
+    __m128i sign = _mm_srai_epi32(v, 31);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, sign));
+    return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, sign));
+}
+
+static inline int64_t horizontal_sum_sse(__m128i acc) {
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1];
+}
+
+int64_t sum_int_sse(const int32_t *values, uint64_t mask) {
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < 64; i += 4) {
+        unsigned m = (unsigned)(mask >> i) & 0xf;
+        if (m) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i)), lane_mask_sse(m));
+            acc = add_widened_sse(acc, v);
+        }
+    }
+    return horizontal_sum_sse(acc);
+}
+
+int64_t sum_sub_population_sse(const float *percentages, const int32_t *populations, uint64_t mask) {
+    const __m128 hundred = _mm_set1_ps(100.0f);
+    const __m128 int_limit = _mm_set1_ps(2147483648.0f);
+    __m128i acc = _mm_setzero_si128();
+    int64_t overflow_total = 0;
+    for (int i = 0; i < 64; i += 4) {
+        unsigned m = (unsigned)(mask >> i) & 0xf;
+        if (!m) {
+            continue;
+        }
+        __m128 population = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(populations + i)));
+        __m128 product = _mm_mul_ps(_mm_div_ps(_mm_loadu_ps(percentages + i), hundred), population);
+
+        // Products that do not fit in int32 are truncated on the scalar path
+        unsigned too_big = (unsigned)_mm_movemask_ps(_mm_cmpge_ps(product, int_limit)) & m;
+        if (too_big) {
+            overflow_total += sum_sub_population_scalar(percentages + i, populations + i, too_big);
+            m &= ~too_big;
+        }
+        __m128i truncated = _mm_and_si128(_mm_cvttps_epi32(product), lane_mask_sse(m));
+        acc = add_widened_sse(acc, truncated);
+    }
+    return horizontal_sum_sse(acc) + overflow_total;
+}
+
+static const KernelSet sse_kernels = {
+    "sse",
+    compare_float_ge_sse, compare_float_le_sse,
+    compare_int_ge_sse, compare_int_le_sse,
+    sum_int_sse, sum_sub_population_sse
+};
+
+__attribute__((target("avx2")))
+uint64_t compare_float_ge_avx2(const void *values, float threshold) {
+    const float *v = values;
+    __m256 t = _mm256_set1_ps(threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 8) {
+        bits |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(v + i), t, _CMP_GE_OQ)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+uint64_t compare_float_le_avx2(const void *values, float threshold) {
+    const float *v = values;
+    __m256 t = _mm256_set1_ps(threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 8) {
+        bits |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(v + i), t, _CMP_LE_OQ)) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+uint64_t compare_int_ge_avx2(const void *values, float threshold) {
+    const int32_t *v = values;
+    __m256i t = _mm256_set1_epi32((int)threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 8) {
+        __m256i gt = _mm256_cmpgt_epi32(t, _mm256_loadu_si256((const __m256i *)(v + i)));
+        bits |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(gt)) & 0xff) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+uint64_t compare_int_le_avx2(const void *values, float threshold) {
+    const int32_t *v = values;
+    __m256i t = _mm256_set1_epi32((int)threshold);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 8) {
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(v + i)), t);
+        bits |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(gt)) & 0xff) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lane_mask_avx2(unsigned mask8) {
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int)mask8), lane_bits), lane_bits);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i add_widened_avx2(__m256i acc, __m256i v) {
+    acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+    return _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+static inline int64_t horizontal_sum_avx2(__m256i acc) {
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+int64_t sum_int_avx2(const int32_t *values, uint64_t mask) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < 64; i += 8) {
+        unsigned m = (unsigned)(mask >> i) & 0xff;
+        if (m) {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(values + i)), lane_mask_avx2(m));
+            acc = add_widened_avx2(acc, v);
+        }
+    }
+    return horizontal_sum_avx2(acc);
+}
+
+__attribute__((target("avx2")))
+int64_t sum_sub_population_avx2(const float *percentages, const int32_t *populations, uint64_t mask) {
+    const __m256 hundred = _mm256_set1_ps(100.0f);
+    const __m256 int_limit = _mm256_set1_ps(2147483648.0f);
+    __m256i acc = _mm256_setzero_si256();
+    int64_t overflow_total = 0;
+    for (int i = 0; i < 64; i += 8) {
+        unsigned m = (unsigned)(mask >> i) & 0xff;
+        if (!m) {
+            continue;
+        }
+        __m256 population = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(populations + i)));
+        __m256 product = _mm256_mul_ps(_mm256_div_ps(_mm256_loadu_ps(percentages + i), hundred), population);
+
+        // Products that do not fit in int32 are truncated on the scalar path
+        unsigned too_big = (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(product, int_limit, _CMP_GE_OQ)) & m;
+        if (too_big) {
+            overflow_total += sum_sub_population_scalar(percentages + i, populations + i, too_big);
+            m &= ~too_big;
+        }
+        __m256i truncated = _mm256_and_si256(_mm256_cvttps_epi32(product), lane_mask_avx2(m));
+        acc = add_widened_avx2(acc, truncated);
+    }
+    return horizontal_sum_avx2(acc) + overflow_total;
+}
+
+static const KernelSet avx2_kernels = {
+    "avx2",
+    compare_float_ge_avx2, compare_float_le_avx2,
+    compare_int_ge_avx2, compare_int_le_avx2,
+    sum_int_avx2, sum_sub_population_avx2
+};
+
+#endif
+
+const KernelSet *kernels = &scalar_kernels;
+
+// Pick the widest kernel set this CPU supports, or the one named by
+// --kernels. Returns -1 if the requested set is unknown or unsupported.
+int select_kernels(const char *requested) {
+    const KernelSet *best = &scalar_kernels;
+#ifdef HAVE_X86_KERNELS
+    best = &sse_kernels;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        best = &avx2_kernels;
+    }
+#endif
+    if (!requested) {
+        kernels = best;
+        return 0;
+    }
+    if (strcmp(requested, "scalar") == 0) {
+        kernels = &scalar_kernels;
+        return 0;
+    }
+#ifdef HAVE_X86_KERNELS
+    if (strcmp(requested, "sse") == 0) {
+        kernels = &sse_kernels;
+        return 0;
+    }
+    if (strcmp(requested, "avx2") == 0 && best == &avx2_kernels) {
+        kernels = &avx2_kernels;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// Function to display all counties
+void display_counties(Query *q) {
+    const Dataset *ds = q->ds;
+    const Column *columns = ds->columns;
+    fprintf(q->out, "Displaying County Data:\n");
+    fprintf(q->out, "----------------------------------------------------------\n");
+    for (size_t w = 0; w < selection_words(ds); w++) {
+        for (uint64_t bits = q->selection[w]; bits; bits &= bits - 1) {
+            int r = (int)(w * 64) + __builtin_ctzll(bits);
+            fprintf(q->out, "County: %s, State: %s\n", string_table_get(&ds->names, ds->county_ids[r]), string_table_get(&ds->names, ds->state_ids[r]));
+            fprintf(q->out, "  Education (High School or Higher): %.2f%%\n", columns[FIELD_EDUCATION_HIGH_SCHOOL_OR_HIGHER].f[r]);
+            fprintf(q->out, "  Education (Bachelors or Higher): %.2f%%\n", columns[FIELD_EDUCATION_BACHELORS_OR_HIGHER].f[r]);
+            fprintf(q->out, "  Ethnicities:\n");
+            fprintf(q->out, "    White: %.2f%%, Black: %.2f%%, Asian: %.2f%%, Hispanic: %.2f%%, Native Hawaiian:%.2f%%, White Alone:%.2f%%, American Indian:%.2f%%, Two or More Races:%.2f%%\n",
+                   columns[FIELD_ETHNICITY_WHITE].f[r], columns[FIELD_ETHNICITY_BLACK].f[r], columns[FIELD_ETHNICITY_ASIAN].f[r], columns[FIELD_ETHNICITY_HISPANIC].f[r], columns[FIELD_ETHNICITY_NATIVE_HAWAIIAN_AND_OTHER_PACIFIC_ISLANDER].f[r], columns[FIELD_ETHNICITY_WHITE_NOT_HISPANIC].f[r],columns[FIELD_ETHNICITY_AMERICAN_INDIAN_AND_ALASKA_NATIVE].f[r],columns[FIELD_ETHNICITY_TWO_OR_MORE_RACES].f[r]);
+            fprintf(q->out, "  Income:\n");
+            fprintf(q->out, "    Median Household: $%d, Per Capita: $%d, Below Poverty: %.2f%%\n",
+                   columns[FIELD_MEDIAN_HOUSEHOLD_INCOME].i[r], columns[FIELD_PER_CAPITA_INCOME].i[r], columns[FIELD_PERSONS_BELOW_POVERTY_LEVEL].f[r]);
+            fprintf(q->out, "  Population (2014): %d\n", columns[FIELD_POPULATION_2014].i[r]);
+            fprintf(q->out, "----------------------------------------------------------\n");
+        }
+    }
+}
+
+
+// Keep only the selected rows of one state
+void apply_state_filter(Query *q, const char *state_abbr) {
+    const Dataset *ds = q->ds;
+
+    // Intersect the selection with the state's row list from the index;
+    // an unknown state matches nothing
+    uint32_t code = find_state(ds, state_abbr);
+    const int *rows = NULL, *rows_end = NULL;
+    if (code != STATE_NONE) {
+        rows = ds->states.rows + ds->states.row_offsets[code];
+        rows_end = ds->states.rows + ds->states.row_offsets[code + 1];
+    }
+
+    size_t w = 0;
+    int selected = 0;
+    while (rows < rows_end) {
+        size_t word = (size_t)*rows / 64;
+        uint64_t mask = 0;
+        while (rows < rows_end && (size_t)*rows / 64 == word) {
+            mask |= 1ULL << (*rows++ % 64);
+        }
+        for (; w < word; w++) {
+            q->selection[w] = 0;
+        }
+        q->selection[w] &= mask;
+        selected += __builtin_popcountll(q->selection[w++]);
+    }
+    for (; w < selection_words(ds); w++) {
+        q->selection[w] = 0;
+    }
+    q->selected_count = selected;
+    if (code != STATE_NONE) {
+        profile_add_bytes((long long)(ds->states.row_offsets[code + 1] - ds->states.row_offsets[code]) * (long long)sizeof(int));
+    }
+}
+
+void print_state_filter(FILE *out, const char *state_abbr, int selected_count) {
+    fprintf(out, "Filter: state == %s (%d entries)\n", state_abbr, selected_count);
+}
+
+// Function to filter counties by state abbreviation
+void filter_state(Query *q, const char *state_abbr) {
+    apply_state_filter(q, state_abbr);
+
+    // Print the result
+    print_state_filter(q->out, state_abbr, q->selected_count);
+}
+
+// Print a warning for each row set in bits, where bits covers rows word * 64 ..
+void warn_invalid_rows(const Query *q, size_t word, uint64_t bits, const char *message) {
+    for (; bits; bits &= bits - 1) {
+        fprintf(q->out, "Warning: Line %d contains %s and will be skipped.\n", line_of_row(q->ds, word * 64 + __builtin_ctzll(bits)), message);
+    }
+}
+
+// Aggregates given this suffix also print one line per state, using the
+// State column codes from the state index to bucket rows in the same pass
+#define BY_STATE_SUFFIX ":by-state"
+
+// Bits of mask (nonzero) whose rows are in the same state as its lowest row
+uint64_t same_state_bits(const Dataset *ds, size_t word, uint64_t mask) {
+    const uint32_t *codes = ds->states.codes + word * 64;
+    uint32_t code = codes[__builtin_ctzll(mask)];
+    uint64_t same = 0;
+    for (uint64_t bits = mask; bits; bits &= bits - 1) {
+        int bit = __builtin_ctzll(bits);
+        if (codes[bit] == code) {
+            same |= 1ULL << bit;
+        }
+    }
+    return same;
+}
+
+// Mark the states that have at least one selected row
+void selected_states(const Query *q, char *present) {
+    const Dataset *ds = q->ds;
+    memset(present, 0, ds->states.count);
+    for (size_t w = 0; w < selection_words(ds); w++) {
+        for (uint64_t bits = q->selection[w]; bits; ) {
+            uint64_t same = same_state_bits(ds, w, bits);
+            present[ds->states.codes[w * 64 + __builtin_ctzll(same)]] = 1;
+            bits &= ~same;
+        }
+    }
+}
+
+// Print "title" and then "  XX: value" for every state with selected rows
+void print_state_totals(const Query *q, const char *title, const long long *totals) {
+    const Dataset *ds = q->ds;
+    char *present = xmalloc(ds->states.count + 1);
+    selected_states(q, present);
+    fprintf(q->out, "%s\n", title);
+    for (int c = 0; c < ds->states.count; c++) {
+        if (present[c]) {
+            fprintf(q->out, "  %s: %lld\n", string_table_get(&ds->names, ds->states.name_ids[c]), totals[c]);
+        }
+    }
+    free(present);
+}
+
+enum { GROUP_STATE, GROUP_COUNTY };
+
+typedef enum {
+    OP_DISPLAY,
+    OP_FILTER_STATE,
+    OP_FILTER,
+    OP_POPULATION_TOTAL,
+    OP_POPULATION,
+    OP_PERCENT,
+    OP_GROUP_BY,
+    OP_TOP,
+    OP_SORT,
+    OP_INVALID_FILTER,  // filter: that does not match filter:<field>:<ge|le>:<value>
+    OP_UNKNOWN
+} OperationType;
+
+// An operation resolved once, before any rows are scanned
+typedef struct {
+    OperationType type;
+    const char *text;          // the operation as given
+    char field[MAX_NAME_LEN];  // field name, or state for filter-state:
+    char comparison[3];
+    float value;
+    int field_id;              // resolved column; -1 if unknown or non-numeric
+    int non_numeric;           // filter on County or State
+    CompareWordFn compare;
+    int by_state;              // aggregate with a :by-state suffix
+    int group_column;          // group-by: GROUP_STATE or GROUP_COUNTY; -1 if unsupported
+    int limit;                 // top: and sort: rows to print; 0 if malformed
+    int descending;            // top: and sort:desc
+    int field_count;           // percent: and population: fields, each resolved
+    char fields[MAX_PERCENT_FIELDS][MAX_NAME_LEN];
+    int field_ids[MAX_PERCENT_FIELDS];
+} Operation;
+
+// Parse an operation string and resolve its field and kernel
+void compile_operation(const char *text, Operation *op) {
+    memset(op, 0, sizeof(*op));
+    op->text = text;
+    op->field_id = -1;
+
+    if (strcmp(text, "display") == 0) {
+        op->type = OP_DISPLAY;
+    } else if (strncmp(text, "filter-state:", 13) == 0) {
+        op->type = OP_FILTER_STATE;
+        snprintf(op->field, sizeof(op->field), "%s", text + 13);
+    } else if (strncmp(text, "filter:", 7) == 0) {
+        // Adjust parsing to handle underscores and validate the operation format
+        if (sscanf(text + 7, "%99[^:]:%2s:%f", op->field, op->comparison, &op->value) != 3) {
+            op->type = OP_INVALID_FILTER;
+            return;
+        }
+        op->type = OP_FILTER;
+        op->non_numeric = strcmp(op->field, "County") == 0 || strcmp(op->field, "State") == 0;
+        op->field_id = find_field(op->field);
+        if (op->field_id >= 0) {
+            int ge = strcmp(op->comparison, "ge") == 0;
+            int le = strcmp(op->comparison, "le") == 0;
+            if (field_info[op->field_id].type == COLUMN_FLOAT) {
+                op->compare = ge ? kernels->compare_float_ge : le ? kernels->compare_float_le : compare_none;
+            } else {
+                op->compare = ge ? kernels->compare_int_ge : le ? kernels->compare_int_le : compare_none;
+            }
+        }
+    } else if (strncmp(text, "group-by:", 9) == 0) {
+        // group-by:<State|County>[:<field>], the field defaulting to population
+        char column[MAX_NAME_LEN] = "";
+        int parsed = sscanf(text + 9, "%99[^:]:%99s", column, op->field);
+        if (parsed < 2) {
+            snprintf(op->field, sizeof(op->field), "%s", field_info[FIELD_POPULATION_2014].name);
+        }
+        op->type = OP_GROUP_BY;
+        op->group_column = strcmp(column, "State") == 0 ? GROUP_STATE : strcmp(column, "County") == 0 ? GROUP_COUNTY : -1;
+        op->field_id = find_field(op->field);
+    } else if (strncmp(text, "top:", 4) == 0 || strncmp(text, "sort:", 5) == 0) {
+        // top:<field>:<k> ranks by largest value; sort:<field>:<asc|desc>
+        // is a ranking without a limit
+        int is_top = text[0] == 't';
+        char order[MAX_NAME_LEN] = "";
+        op->type = is_top ? OP_TOP : OP_SORT;
+        if (sscanf(text + (is_top ? 4 : 5), "%99[^:]:%99s", op->field, order) == 2) {
+            char *end;
+            long k = strtol(order, &end, 10);
+            if (is_top) {
+                op->limit = *end == '\0' && end != order && k > 0 && k <= INT32_MAX ? (int)k : 0;
+                op->descending = 1;
+            } else if (strcmp(order, "asc") == 0 || strcmp(order, "desc") == 0) {
+                op->limit = INT32_MAX;
+                op->descending = order[0] == 'd';
+            }
+        }
+        op->field_id = find_field(op->field);
+    } else if (strcmp(text, "population-total") == 0 || strcmp(text, "population-total" BY_STATE_SUFFIX) == 0) {
+        op->type = OP_POPULATION_TOTAL;
+        op->by_state = text[16] != '\0';
+    } else if (strncmp(text, "population:", 11) == 0 || strncmp(text, "percent:", 8) == 0) {
+        int is_population = strncmp(text, "population:", 11) == 0;
+        op->type = is_population ? OP_POPULATION : OP_PERCENT;
+        // The field list is read from text itself, so it may be longer
+        // than any one name
+        const char *list = text + (is_population ? 11 : 8);
+        size_t length = strlen(list), suffix = strlen(BY_STATE_SUFFIX);
+        if (length > suffix && strcmp(list + length - suffix, BY_STATE_SUFFIX) == 0) {
+            length -= suffix;
+            op->by_state = 1;
+        }
+        const char *list_end = list + length;
+
+        // percent: takes a comma separated list of fields; empty names are skipped
+        for (const char *name = list; name < list_end;) {
+            const char *name_end = is_population ? list_end : memchr(name, ',', (size_t)(list_end - name));
+            if (!name_end) {
+                name_end = list_end;
+            }
+            if (name_end > name) {
+                if (op->field_count == MAX_PERCENT_FIELDS) {
+                    op->type = OP_UNKNOWN;
+                    return;
+                }
+                // A name too long to store cannot be a field
+                size_t name_length = (size_t)(name_end - name);
+                snprintf(op->fields[op->field_count], MAX_NAME_LEN, "%.*s", (int)name_length, name);
+                int id = name_length < MAX_NAME_LEN ? find_field(op->fields[op->field_count]) : -1;
+                op->field_ids[op->field_count++] = id >= 0 && field_info[id].is_percentage ? id : -1;
+            }
+            name = name_end + 1;
+        }
+        if (op->field_count == 0) {
+            // percent: with no field at all
+            op->field_ids[op->field_count++] = -1;
+        }
+        if (is_population) {
+            snprintf(op->field, sizeof(op->field), "%s", op->fields[0]);
+            op->field_id = op->field_ids[0];
+        }
+    } else {
+        op->type = OP_UNKNOWN;
+    }
+}
+
+enum { ZONE_NONE, ZONE_SOME, ZONE_ALL };
+
+// Whether every, no or only some valid value in zone z passes op. Uses the
+// same comparisons as the kernels, including truncating the value for
+// int columns.
+int zone_match(const Column *column, const Operation *op, size_t z) {
+    int ge = strcmp(op->comparison, "ge") == 0;
+    int le = strcmp(op->comparison, "le") == 0;
+    if (!ge && !le) {
+        return ZONE_NONE;
+    }
+    int all, none;
+    if (field_info[op->field_id].type == COLUMN_FLOAT) {
+        float min = column->zone_min.f[z], max = column->zone_max.f[z];
+        all = ge ? min >= op->value : max <= op->value;
+        none = ge ? max < op->value : min > op->value;
+    } else {
+        int32_t min = column->zone_min.i[z], max = column->zone_max.i[z];
+        int t = (int)op->value;
+        all = ge ? min >= t : max <= t;
+        none = ge ? max < t : min > t;
+    }
+    return all ? ZONE_ALL : none ? ZONE_NONE : ZONE_SOME;
+}
+
+typedef struct {
+    Query *q;
+    const Operation *op;
+    int *counts;            // rows still selected, per morsel
+} FilterJob;
+
+// Only this field's values and validity bits are read, one word of 64
+// rows at a time; words with nothing selected are skipped, and so are the
+// values of zones the zone map settles on its own. Int fields are compared
+// whether or not they are valid, as they always have been, but the zone
+// map only covers valid values, so invalid rows are compared one by one.
+void filter_morsel_task(void *arg, int morsel) {
+    FilterJob *job = arg;
+    const Dataset *ds = job->q->ds;
+    const Column *column = &ds->columns[job->op->field_id];
+    int compare_invalid = field_info[job->op->field_id].type == COLUMN_INT;
+    uint64_t *selection = job->q->selection;
+    size_t first, last;
+    morsel_words(ds, morsel, &first, &last);
+
+    int count = 0;
+    long long bytes = 0;
+    for (size_t z = first / ZONE_WORDS; z * ZONE_WORDS < last; z++) {
+        int match = zone_match(column, job->op, z);
+        size_t zone_last = (z + 1) * ZONE_WORDS < last ? (z + 1) * ZONE_WORDS : last;
+        for (size_t w = z * ZONE_WORDS; w < zone_last; w++) {
+            if (!selection[w]) {
+                continue;
+            }
+            uint64_t invalid = compare_invalid ? selection[w] & ~column->valid[w] : 0;
+            if (match != ZONE_SOME && invalid) {
+                invalid &= job->op->compare(column->f + w * 64, job->op->value);
+                bytes += 64 * sizeof(float);
+            }
+            if (match == ZONE_ALL) {
+                selection[w] &= column->valid[w] | invalid;
+                bytes += sizeof(uint64_t);
+            } else if (match == ZONE_NONE) {
+                selection[w] = invalid;
+            } else if (compare_invalid) {
+                selection[w] &= job->op->compare(column->f + w * 64, job->op->value);
+                bytes += 64 * sizeof(float);
+            } else {
+                selection[w] &= column->valid[w] & job->op->compare(column->f + w * 64, job->op->value);
+                bytes += sizeof(uint64_t) + 64 * sizeof(float);
+            }
+            count += __builtin_popcountll(selection[w]);
+        }
+    }
+    job->counts[morsel] = count;
+    profile_add_bytes(bytes);
+}
+
+// Apply a filter: operation to the selection, printing its warnings.
+// Returns nonzero (after printing an error) if the field is unsupported.
+int apply_field_filter(Query *q, const Operation *op) {
+    const Dataset *ds = q->ds;
+    if (op->non_numeric) {
+        // County and State are accepted but are not numeric
+        for (size_t w = 0; w < selection_words(ds); w++) {
+            for (uint64_t bits = q->selection[w]; bits; bits &= bits - 1) {
+                fprintf(q->out, "Non-numeric values in field: %s (Line %d)\n", op->field, line_of_row(ds, w * 64 + __builtin_ctzll(bits)));
+            }
+            q->selection[w] = 0;
+        }
+        q->selected_count = 0;
+    } else if (op->field_id < 0) {
+        fprintf(q->err, "Error: Unsupported field '%s'\n", op->field);
+        return -1;
+    } else {
+        // Warnings only need the bitmaps, so they are printed in line
+        // order before the morsels are filtered in parallel
+        const Column *column = &ds->columns[op->field_id];
+        for (size_t w = 0; field_info[op->field_id].type == COLUMN_FLOAT && w < selection_words(ds); w++) {
+            warn_invalid_rows(q, w, q->selection[w] & ~column->valid[w], "invalid data");
+        }
+
+        FilterJob job = {q, op, xcalloc(morsel_count(ds), sizeof(int))};
+        run_morsels(ds, filter_morsel_task, &job);
+        q->selected_count = 0;
+        for (int m = 0; m < morsel_count(ds); m++) {
+            q->selected_count += job.counts[m];
+        }
+        free(job.counts);
+    }
+    return 0;
+}
+
+void print_field_filter(FILE *out, const Operation *op, int selected_count) {
+    fprintf(out, "Filter: %s %s %.2f (%d entries)\n", op->field, op->comparison, op->value, selected_count);
+}
+
+void filter_field(Query *q, const Operation *op) {
+    if (apply_field_filter(q, op) != 0) {
+        return;
+    }
+
+    // Print the result
+    print_field_filter(q->out, op, q->selected_count);
+}
+
+// Population aggregates (population-total, population: and percent:) sum
+// whole words with the kernels, one morsel per task. A scan computes any
+// number of measures at once: the population itself (field -1) or the
+// sub-population of a percentage field. The sums are integers, so adding
+// the per-morsel partials in morsel order gives exactly the
+// single-threaded result. Rows to warn about are only flagged per morsel
+// while scanning and printed in line order when a measure is reported.
+
+struct AggregateScan {
+    int measure_count;
+    int *field_ids;           // per measure
+    int morsels;
+    long long *totals;        // per measure
+    long long *state_totals;  // per measure and state code, or NULL
+    char *has_skipped;        // per morsel and measure: some selected row was skipped
+};
+
+typedef struct {
+    const Query *q;
+    AggregateScan *scan;
+    long long *sums;          // per morsel and measure
+    long long *state_sums;    // per morsel, measure and state code, or NULL
+} AggregateJob;
+
+// Split word w of the selection into the rows an aggregate counts and the
+// rows it skips for a bad population or a bad percentage
+uint64_t aggregate_rows(const Query *q, int field_id, size_t w, uint64_t *bad_population, uint64_t *bad_percentage) {
+    const Dataset *ds = q->ds;
+    const Column *population = &ds->columns[FIELD_POPULATION_2014];
+    uint64_t selected = q->selection[w];
+    *bad_population = selected & ~population->valid[w];
+    *bad_percentage = 0;
+    if (field_id >= 0) {
+        // Percentages must also be valid and at most 100
+        const Column *column = &ds->columns[field_id];
+        uint64_t good_percentage = column->valid[w] & kernels->compare_float_le(column->f + w * 64, 100.0f);
+        *bad_percentage = selected & ~*bad_population & ~good_percentage;
+    }
+    return selected & ~*bad_population & ~*bad_percentage;
+}
+
+void aggregate_morsel_task(void *arg, int morsel) {
+    AggregateJob *job = arg;
+    const Dataset *ds = job->q->ds;
+    const AggregateScan *scan = job->scan;
+    const int32_t *population = ds->columns[FIELD_POPULATION_2014].i;
+    int measures = scan->measure_count, states = ds->states.count;
+    long long *sums = job->sums + (size_t)morsel * measures;
+    long long *state_sums = job->state_sums ? job->state_sums + (size_t)morsel * measures * states : NULL;
+    size_t first, last;
+    morsel_words(ds, morsel, &first, &last);
+
+    // Each selected word is visited once for all the measures
+    long long bytes = 0;
+    for (size_t w = first; w < last; w++) {
+        if (!job->q->selection[w]) {
+            continue;
+        }
+        for (int k = 0; k < measures; k++) {
+            int field_id = scan->field_ids[k];
+            const float *percentages = field_id >= 0 ? ds->columns[field_id].f : NULL;
+            uint64_t bad_population, bad_percentage;
+            uint64_t counted = aggregate_rows(job->q, field_id, w, &bad_population, &bad_percentage);
+            if (bad_population | bad_percentage) {
+                scan->has_skipped[(size_t)morsel * measures + k] = 1;
+            }
+            bytes += percentages ? 2 * (sizeof(uint64_t) + 64 * sizeof(float)) : sizeof(uint64_t) + 64 * sizeof(int32_t);
+
+            // Percentages are divided by 100 to convert to a fraction
+            while (counted) {
+                uint64_t rows = state_sums ? same_state_bits(ds, w, counted) : counted;
+                long long sum = percentages ? kernels->sum_sub_population(percentages + w * 64, population + w * 64, rows)
+                                            : kernels->sum_int(population + w * 64, rows);
+                if (state_sums) {
+                    state_sums[(size_t)k * states + ds->states.codes[w * 64 + __builtin_ctzll(rows)]] += sum;
+                }
+                sums[k] += sum;
+                counted &= ~rows;
+            }
+        }
+    }
+    profile_add_bytes(bytes);
+}
+
+// Scan the selection once for every measure in scan->field_ids, per state
+// as well if by_state is set
+void aggregate_scan_run(Query *q, AggregateScan *scan, int by_state) {
+    const Dataset *ds = q->ds;
+    int measures = scan->measure_count, states = ds->states.count;
+    scan->morsels = morsel_count(ds);
+    scan->totals = xcalloc(measures, sizeof(long long));
+    scan->state_totals = by_state ? xcalloc((size_t)measures * states + 1, sizeof(long long)) : NULL;
+    scan->has_skipped = xcalloc((size_t)scan->morsels * measures, 1);
+
+    AggregateJob job = {q, scan, xcalloc((size_t)scan->morsels * measures, sizeof(long long)), NULL};
+    if (by_state) {
+        job.state_sums = xcalloc((size_t)scan->morsels * measures * states + 1, sizeof(long long));
+    }
+    run_morsels(ds, aggregate_morsel_task, &job);
+
+    for (int m = 0; m < scan->morsels; m++) {
+        for (int k = 0; k < measures; k++) {
+            scan->totals[k] += job.sums[(size_t)m * measures + k];
+        }
+        for (size_t i = 0; by_state && i < (size_t)measures * states; i++) {
+            scan->state_totals[i] += job.state_sums[(size_t)m * measures * states + i];
+        }
+    }
+    free(job.sums);
+    free(job.state_sums);
+}
+
+void aggregate_scan_free(AggregateScan *scan) {
+    free(scan->field_ids);
+    free(scan->totals);
+    free(scan->state_totals);
+    free(scan->has_skipped);
+    free(scan);
+}
+
+// Print the warnings of measure k in line order
+void print_measure_warnings(Query *q, const AggregateScan *scan, int k, const char *field) {
+    const Dataset *ds = q->ds;
+    int field_id = scan->field_ids[k];
+    for (int m = 0; m < scan->morsels; m++) {
+        if (!scan->has_skipped[(size_t)m * scan->measure_count + k]) {
+            continue;
+        }
+
+        // Report both kinds of problem in line order
+        size_t first, last;
+        morsel_words(ds, m, &first, &last);
+        for (size_t w = first; w < last; w++) {
+            uint64_t bad_population, bad_percentage;
+            aggregate_rows(q, field_id, w, &bad_population, &bad_percentage);
+            if (field_id < 0) {
+                warn_invalid_rows(q, w, bad_population, "invalid population data");
+                continue;
+            }
+            for (uint64_t bad = bad_population | bad_percentage; bad; bad &= bad - 1) {
+                int bit = __builtin_ctzll(bad);
+                int line = line_of_row(ds, w * 64 + bit);
+                if ((bad_population >> bit) & 1) {
+                    fprintf(q->out, "Warning: Line %d contains invalid population data and will be skipped.\n", line);
+                } else {
+                    fprintf(q->out, "Warning: Line %d contains invalid percentage data for '%s' and will be skipped.\n", line, field);
+                }
+            }
+        }
+    }
+}
+
+int is_aggregate_operation(const Operation *op) {
+    return op->type == OP_POPULATION_TOTAL || op->type == OP_POPULATION || op->type == OP_PERCENT;
+}
+
+// Before the first of a run of aggregate operations, scan once for every
+// measure the run needs; they all see the same selection
+void fuse_aggregates(Query *q, const Operation *ops, int count) {
+    AggregateScan *scan = xcalloc(1, sizeof(AggregateScan));
+    scan->field_ids = xmalloc((1 + (size_t)count * MAX_PERCENT_FIELDS) * sizeof(int));
+    int by_state = 0;
+    for (int i = 0; i < count && is_aggregate_operation(&ops[i]); i++) {
+        by_state |= ops[i].by_state;
+        int wanted[1 + MAX_PERCENT_FIELDS], wanted_count = 0;
+        if (ops[i].type != OP_POPULATION) {
+            wanted[wanted_count++] = -1;
+        }
+        for (int f = 0; ops[i].type != OP_POPULATION_TOTAL && f < ops[i].field_count; f++) {
+            if (ops[i].field_ids[f] >= 0) {
+                wanted[wanted_count++] = ops[i].field_ids[f];
+            }
+        }
+        for (int w = 0; w < wanted_count; w++) {
+            int k = 0;
+            while (k < scan->measure_count && scan->field_ids[k] != wanted[w]) {
+                k++;
+            }
+            if (k == scan->measure_count) {
+                scan->field_ids[scan->measure_count++] = wanted[w];
+            }
+        }
+    }
+    aggregate_scan_run(q, scan, by_state);
+    q->fused = scan;
+}
+
+// Sum the selection for population-total (field_id -1) or one percentage
+// field, printing the warnings; fills by_state if it is not NULL. Uses the
+// fused scan when it has the measure.
+long long aggregate_population(Query *q, const char *field, int field_id, long long *by_state) {
+    const AggregateScan *scan = q->fused;
+    int k = 0;
+    while (scan && k < scan->measure_count && scan->field_ids[k] != field_id) {
+        k++;
+    }
+
+    AggregateScan single = {0};
+    if (!scan || k == scan->measure_count || (by_state && !scan->state_totals)) {
+        single.measure_count = 1;
+        single.field_ids = xmalloc(sizeof(int));
+        single.field_ids[0] = field_id;
+        aggregate_scan_run(q, &single, by_state != NULL);
+        scan = &single;
+        k = 0;
+    }
+
+    print_measure_warnings(q, scan, k, field);
+    for (int c = 0; by_state && c < q->ds->states.count; c++) {
+        by_state[c] += scan->state_totals[(size_t)k * q->ds->states.count + c];
+    }
+    long long total = scan->totals[k];
+    free(single.field_ids);
+    free(single.totals);
+    free(single.state_totals);
+    free(single.has_skipped);
+    return total;
+}
+
+void print_population_total(FILE *out, long long total_population) {
+    fprintf(out, "2014 population: %lld\n", total_population);
+}
+
+void print_population_field(FILE *out, const char *field, long long total_sub_population) {
+    fprintf(out, "2014 %s population: %lld\n", field, total_sub_population);
+}
+
+// Total 2014 population of the selection. If by_state is not NULL it
+// receives the total of each state (indexed by state code) as well.
+long long population_total(Query *q, long long *by_state) {
+    long long total_population = aggregate_population(q, NULL, -1, by_state);
+
+    // Print the total population
+    if (by_state) {
+        print_state_totals(q, "2014 population by state:", by_state);
+    }
+    print_population_total(q->out, total_population);
+    return total_population;
+}
+
+// Sum of percentage * population over the selection for a percentage
+// field resolved by compile_operation, and per state if by_state is not
+// NULL. Returns -1 if the field was invalid.
+long long population_field(Query *q, const char *field, int field_id, long long *by_state) {
+    // Stop if the field is invalid
+    if (field_id < 0) {
+        fprintf(q->err, "Error: Invalid field '%s'.\n", field);
+        return -1;
+    }
+
+    // Rows need a valid population and a valid percentage of at most 100
+    long long total_sub_population = aggregate_population(q, field, field_id, by_state);
+
+    // Print the total sub-population
+    if (by_state) {
+        char title[MAX_NAME_LEN + 32];
+        snprintf(title, sizeof(title), "2014 %s population by state:", field);
+        print_state_totals(q, title, by_state);
+    }
+    print_population_field(q->out, field, total_sub_population);
+    return total_sub_population;
+}
+
+
+void print_percentage(FILE *out, const char *field, long long total_population, long long total_sub_population) {
+    double percentage = ((double)total_sub_population / total_population) * 100;
+    fprintf(out, "2014 %s percentage: %.2f%%\n", field, percentage);
+}
+
+// percent:A,B,C prints the population total once, then each field's
+// sub-population and percentage. Returns -1 at the first invalid field.
+int percent_sub_population(Query *q, const Operation *op) {
+    const Dataset *ds = q->ds;
+    long long *state_population = NULL, *state_sub_population = NULL;
+    if (op->by_state) {
+        state_population = xcalloc(ds->states.count + 1, sizeof(long long));
+        state_sub_population = xcalloc(ds->states.count + 1, sizeof(long long));
+    }
+    int status = 0;
+    long long total_population = population_total(q, state_population);
+    for (int f = 0; f < op->field_count; f++) {
+        const char *field = op->fields[f];
+        if (state_sub_population) {
+            memset(state_sub_population, 0, ds->states.count * sizeof(long long));
+        }
+        long long total_sub_population = population_field(q, field, op->field_ids[f], state_sub_population);
+        if (total_sub_population < 0) {
+            status = -1;
+            break;
+        }
+        if (op->by_state) {
+            char *present = xmalloc(ds->states.count + 1);
+            selected_states(q, present);
+            fprintf(q->out, "2014 %s percentage by state:\n", field);
+            for (int c = 0; c < ds->states.count; c++) {
+                if (present[c]) {
+                    double percentage = ((double)state_sub_population[c] / state_population[c]) * 100;
+                    fprintf(q->out, "  %s: %.2f%%\n", string_table_get(&ds->names, ds->states.name_ids[c]), percentage);
+                }
+            }
+            free(present);
+        }
+        print_percentage(q->out, field, total_population, total_sub_population);
+    }
+    free(state_population);
+    free(state_sub_population);
+    return status;
+}
+
+// group-by:<column>[:<field>] aggregates the selection per State, or per
+// county keyed by (County, State), in one pass. Every group gets its
+// selected row count and, over the rows whose field and population are
+// valid, the field's sum, min and max, its population-weighted mean (a
+// plain mean when the field is the population itself) and a percent: the
+// share of the group's population for percentage fields (as percent:
+// computes), the group's share of the overall sum otherwise. For
+// percentage fields the sum is the sub-population, as population:
+// computes it. A group none of whose rows had valid data shows only its
+// count.
+//
+// Each morsel is aggregated into its own hash table and the tables are
+// merged in morsel order, so the result does not depend on the thread
+// count.
+
+typedef struct {
+    uint64_t key;           // row_key of a county, or the id in names of a State
+    int count;              // selected rows
+    int counted;            // rows that had valid data
+    long long sum;
+    double value_sum;       // the sum without rounding, shown for fractional fields that are not percentages
+    long long population;   // of counted rows
+    long long weight;       // population, or 1 per row when grouping population itself
+    double weighted;        // sum of value * weight
+    double min;
+    double max;
+} GroupAggregate;
+
+typedef struct {
+    GroupAggregate *slots;  // open addressing; count == 0 marks a free slot
+    int slot_count;         // power of two
+    int used;
+} GroupTable;
+
+void group_table_init(GroupTable *table, int slot_count) {
+    table->slots = xcalloc(slot_count, sizeof(GroupAggregate));
+    table->slot_count = slot_count;
+    table->used = 0;
+}
+
+GroupAggregate *group_table_find(GroupTable *table, uint64_t key);
+
+void group_table_grow(GroupTable *table) {
+    GroupTable bigger;
+    group_table_init(&bigger, table->slot_count * 2);
+    for (int i = 0; i < table->slot_count; i++) {
+        if (table->slots[i].count) {
+            *group_table_find(&bigger, table->slots[i].key) = table->slots[i];
+        }
+    }
+    free(table->slots);
+    *table = bigger;
+}
+
+// The group for key, inserted empty (count 0) if it is new. The caller
+// must give a new group a nonzero count before the next lookup.
+GroupAggregate *group_table_find(GroupTable *table, uint64_t key) {
+    if (2 * (table->used + 1) > table->slot_count) {
+        group_table_grow(table);
+    }
+    uint32_t mask = (uint32_t)table->slot_count - 1;
+    for (uint32_t i = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;; i = (i + 1) & mask) {
+        GroupAggregate *group = &table->slots[i];
+        if (group->count == 0) {
+            memset(group, 0, sizeof(*group));
+            group->key = key;
+            group->min = INFINITY;
+            group->max = -INFINITY;
+            table->used++;
+            return group;
+        }
+        if (group->key == key) {
+            return group;
+        }
+    }
+}
+
+typedef struct {
+    const Query *q;
+    const Operation *op;
+    GroupTable *tables;     // one per morsel
+} GroupJob;
+
+// Rows of word w that group-by counts, like population: does for
+// percentage fields
+uint64_t group_valid_rows(const Dataset *ds, int field_id, size_t w) {
+    const Column *population = &ds->columns[FIELD_POPULATION_2014];
+    const Column *column = &ds->columns[field_id];
+    uint64_t valid = population->valid[w] & column->valid[w];
+    if (field_info[field_id].is_percentage) {
+        valid &= kernels->compare_float_le(column->f + w * 64, 100.0f);
+    }
+    return valid;
+}
+
+void group_morsel_task(void *arg, int morsel) {
+    GroupJob *job = arg;
+    const Dataset *ds = job->q->ds;
+    const Column *population = &ds->columns[FIELD_POPULATION_2014];
+    const Column *column = &ds->columns[job->op->field_id];
+    int is_float = field_info[job->op->field_id].type == COLUMN_FLOAT;
+    int is_percentage = field_info[job->op->field_id].is_percentage;
+    int by_county = job->op->group_column == GROUP_COUNTY;
+    GroupTable *table = &job->tables[morsel];
+    group_table_init(table, 64);
+
+    size_t first, last;
+    morsel_words(ds, morsel, &first, &last);
+    long long bytes = 0;
+    for (size_t w = first; w < last; w++) {
+        uint64_t selected = job->q->selection[w];
+        if (!selected) {
+            continue;
+        }
+        uint64_t valid = group_valid_rows(ds, job->op->field_id, w);
+        bytes += 2 * sizeof(uint64_t) + __builtin_popcountll(selected) * (sizeof(uint32_t) + 2 * sizeof(float));
+        for (; selected; selected &= selected - 1) {
+            int bit = __builtin_ctzll(selected);
+            size_t r = w * 64 + bit;
+            GroupAggregate *group = group_table_find(table, by_county ? row_key(ds, (int)r) : ds->state_ids[r]);
+            group->count++;
+            if (!((valid >> bit) & 1)) {
+                continue;
+            }
+            double value = is_float ? column->f[r] : column->i[r];
+            int32_t people = population->i[r];
+            group->counted++;
+            group->sum += is_percentage ? (long long)((column->f[r] / 100) * people) : (long long)value;
+            group->value_sum += value;
+            int weight = job->op->field_id == FIELD_POPULATION_2014 ? 1 : people;
+            group->population += people;
+            group->weight += weight;
+            group->weighted += value * weight;
+            group->min = value < group->min ? value : group->min;
+            group->max = value > group->max ? value : group->max;
+        }
+    }
+    profile_add_bytes(bytes);
+}
+
+typedef struct {
+    const char *name;
+    const char *state;      // of a county, or NULL
+    const GroupAggregate *group;
+} NamedGroup;
+
+int compare_named_groups(const void *a, const void *b) {
+    const NamedGroup *x = a, *y = b;
+    int order = strcmp(x->name, y->name);
+    return order != 0 || !x->state ? order : strcmp(x->state, y->state);
+}
+
+// Returns -1 if the column or field is not supported
+int group_by(Query *q, const Operation *op) {
+    const Dataset *ds = q->ds;
+    if (op->group_column < 0) {
+        fprintf(q->err, "Error: Cannot group by '%s'. Use State or County.\n", op->text + 9);
+        return -1;
+    }
+    if (op->field_id < 0) {
+        fprintf(q->err, "Error: Invalid field '%s'.\n", op->field);
+        return -1;
+    }
+
+    // Report skipped rows in line order, as the other aggregates do
+    for (size_t w = 0; w < selection_words(ds); w++) {
+        uint64_t bad_population = q->selection[w] & ~ds->columns[FIELD_POPULATION_2014].valid[w];
+        uint64_t bad = q->selection[w] & ~group_valid_rows(ds, op->field_id, w);
+        for (; bad; bad &= bad - 1) {
+            int bit = __builtin_ctzll(bad);
+            int line = line_of_row(ds, w * 64 + bit);
+            if ((bad_population >> bit) & 1) {
+                fprintf(q->out, "Warning: Line %d contains invalid population data and will be skipped.\n", line);
+            } else {
+                fprintf(q->out, "Warning: Line %d contains invalid data for '%s' and will be skipped.\n", line, op->field);
+            }
+        }
+    }
+
+    // Aggregate every morsel, then merge the morsel tables in order
+    GroupJob job = {q, op, NULL};
+    int morsels = morsel_count(ds);
+    job.tables = xcalloc(morsels, sizeof(GroupTable));
+    run_morsels(ds, group_morsel_task, &job);
+
+    GroupTable merged;
+    group_table_init(&merged, 64);
+    long long total_sum = 0;
+    double total_value_sum = 0;
+    for (int m = 0; m < morsels; m++) {
+        for (int i = 0; i < job.tables[m].slot_count; i++) {
+            const GroupAggregate *part = &job.tables[m].slots[i];
+            if (part->count == 0) {
+                continue;
+            }
+            GroupAggregate *group = group_table_find(&merged, part->key);
+            group->count += part->count;
+            group->counted += part->counted;
+            group->sum += part->sum;
+            group->value_sum += part->value_sum;
+            group->population += part->population;
+            group->weight += part->weight;
+            group->weighted += part->weighted;
+            group->min = part->min < group->min ? part->min : group->min;
+            group->max = part->max > group->max ? part->max : group->max;
+            total_sum += part->sum;
+            total_value_sum += part->value_sum;
+        }
+        free(job.tables[m].slots);
+    }
+    free(job.tables);
+
+    // Print the groups in name order
+    NamedGroup *groups = xmalloc((merged.used + 1) * sizeof(NamedGroup));
+    int group_count = 0;
+    for (int i = 0; i < merged.slot_count; i++) {
+        if (merged.slots[i].count) {
+            uint64_t key = merged.slots[i].key;
+            int by_county = op->group_column == GROUP_COUNTY;
+            groups[group_count].name = string_table_get(&ds->names, by_county ? (uint32_t)(key >> 32) : (uint32_t)key);
+            groups[group_count].state = by_county ? string_table_get(&ds->names, (uint32_t)key) : NULL;
+            groups[group_count++].group = &merged.slots[i];
+        }
+    }
+    qsort(groups, group_count, sizeof(NamedGroup), compare_named_groups);
+
+    int is_percentage = field_info[op->field_id].is_percentage;
+    int fractional = field_info[op->field_id].type == COLUMN_FLOAT && !is_percentage;
+    const char *format = field_info[op->field_id].type == COLUMN_FLOAT ? "%.2f" : "%.0f";
+    fprintf(q->out, "Group by %s: %s (%d groups)\n", op->group_column == GROUP_STATE ? "State" : "County", op->field, group_count);
+    for (int g = 0; g < group_count; g++) {
+        const GroupAggregate *group = groups[g].group;
+        fprintf(q->out, "  %s%s%s: count %d", groups[g].name, groups[g].state ? ", " : "",
+                groups[g].state ? groups[g].state : "", group->count);
+        if (group->counted == 0) {
+            fprintf(q->out, ", no valid data\n");
+            continue;
+        }
+        double mean = group->weight ? group->weighted / group->weight : 0;
+        double percent = is_percentage ? (group->population ? (double)group->sum / group->population * 100 : 0)
+                         : fractional ? (total_value_sum != 0 ? group->value_sum / total_value_sum * 100 : 0)
+                                      : (total_sum != 0 ? (double)group->sum / total_sum * 100 : 0);
+        if (fractional) {
+            fprintf(q->out, ", sum %.2f, mean %.2f, min ", group->value_sum, mean);
+        } else {
+            fprintf(q->out, ", sum %lld, mean %.2f, min ", group->sum, mean);
+        }
+        fprintf(q->out, format, group->min);
+        fprintf(q->out, ", max ");
+        fprintf(q->out, format, group->max);
+        fprintf(q->out, ", percent %.2f%%\n", percent);
+    }
+    free(groups);
+    free(merged.slots);
+    return 0;
+}
+
+// Ranking (top: and sort:). Each selected row with a valid value gets a
+// 64-bit key: the value mapped to an unsigned integer in the same order
+// (inverted for descending order) above the row number, so ascending keys
+// are the ranking and ties keep row order. Only keys are moved around;
+// rows are printed straight from the columns.
+
+static inline uint32_t rank_value_bits(const Column *column, int field_id, size_t r, int descending) {
+    uint32_t bits;
+    if (field_info[field_id].type == COLUMN_FLOAT) {
+        memcpy(&bits, &column->f[r], sizeof(bits));
+        bits = bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+    } else {
+        bits = (uint32_t)column->i[r] ^ 0x80000000u;
+    }
+    return descending ? ~bits : bits;
+}
+
+// Keys of the candidate rows of [first, last) selection words, in row order
+size_t rank_keys(const Query *q, const Operation *op, size_t first, size_t last, uint64_t *keys) {
+    const Column *column = &q->ds->columns[op->field_id];
+    size_t count = 0;
+    for (size_t w = first; w < last; w++) {
+        for (uint64_t bits = q->selection[w] & column->valid[w]; bits; bits &= bits - 1) {
+            size_t r = w * 64 + __builtin_ctzll(bits);
+            keys[count++] = (uint64_t)rank_value_bits(column, op->field_id, r, op->descending) << 32 | r;
+        }
+    }
+    return count;
+}
+
+// Sort keys by their value half with an LSD radix sort, one byte per
+// pass, skipping passes where every key has the same byte. Stable, so
+// keys built in row order stay in row order among equal values.
+void radix_sort_keys(uint64_t *keys, size_t count) {
+    uint64_t *buffer = xmalloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    uint64_t *from = keys, *to = buffer;
+    for (int shift = 32; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            counts[(from[i] >> shift) & 0xff]++;
+        }
+        if (count == 0 || counts[(from[0] >> shift) & 0xff] == count) {
+            continue;
+        }
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t n = counts[b];
+            counts[b] = offset;
+            offset += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[counts[(from[i] >> shift) & 0xff]++] = from[i];
+        }
+        uint64_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != keys) {
+        memcpy(keys, from, count * sizeof(uint64_t));
+    }
+    free(buffer);
+}
+
+// Max-heap of the smallest keys seen so far, at most limit of them
+typedef struct {
+    uint64_t *keys;
+    int count;
+    int limit;
+} KeyHeap;
+
+void key_heap_push(KeyHeap *heap, uint64_t key) {
+    uint64_t *keys = heap->keys;
+    if (heap->count == heap->limit) {
+        if (key >= keys[0]) {
+            return;
+        }
+        // Replace the largest and sift it down
+        int i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= heap->count) {
+                break;
+            }
+            if (child + 1 < heap->count && keys[child + 1] > keys[child]) {
+                child++;
+            }
+            if (keys[child] <= key) {
+                break;
+            }
+            keys[i] = keys[child];
+            i = child;
+        }
+        keys[i] = key;
+        return;
+    }
+    int i = heap->count++;
+    for (; i > 0 && keys[(i - 1) / 2] < key; i = (i - 1) / 2) {
+        keys[i] = keys[(i - 1) / 2];
+    }
+    keys[i] = key;
+}
+
+typedef struct {
+    const Query *q;
+    const Operation *op;
+    KeyHeap *heaps;     // one per morsel
+} TopJob;
+
+void top_morsel_task(void *arg, int morsel) {
+    TopJob *job = arg;
+    const Column *column = &job->q->ds->columns[job->op->field_id];
+    KeyHeap *heap = &job->heaps[morsel];
+    size_t first, last;
+    morsel_words(job->q->ds, morsel, &first, &last);
+    for (size_t w = first; w < last; w++) {
+        for (uint64_t bits = job->q->selection[w] & column->valid[w]; bits; bits &= bits - 1) {
+            size_t r = w * 64 + __builtin_ctzll(bits);
+            key_heap_push(heap, (uint64_t)rank_value_bits(column, job->op->field_id, r, job->op->descending) << 32 | r);
+        }
+    }
+}
+
+int compare_keys(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Print the selected rows ranked by a field: the first limit of them for
+// top:, all of them for sort:. Returns -1 if the operation is malformed or
+// its field unknown.
+int rank_rows(Query *q, const Operation *op) {
+    const Dataset *ds = q->ds;
+    if (op->limit == 0) {
+        fprintf(q->err, op->type == OP_TOP ? "Invalid top operation format. Use: top:<field>:<k>\n"
+                                           : "Invalid sort operation format. Use: sort:<field>:<asc|desc>\n");
+        return -1;
+    }
+    if (op->field_id < 0) {
+        fprintf(q->err, "Error: Invalid field '%s'.\n", op->field);
+        return -1;
+    }
+
+    const Column *column = &ds->columns[op->field_id];
+    char message[MAX_NAME_LEN + 32];
+    snprintf(message, sizeof(message), "invalid data for '%s'", op->field);
+    int candidates = 0;
+    for (size_t w = 0; w < selection_words(ds); w++) {
+        warn_invalid_rows(q, w, q->selection[w] & ~column->valid[w], message);
+        candidates += __builtin_popcountll(q->selection[w] & column->valid[w]);
+    }
+
+    // A small k keeps a heap per morsel and merges them; anything else is
+    // a full sort
+    uint64_t *keys;
+    int count;
+    if ((long long)op->limit * 16 < candidates) {
+        int morsels = morsel_count(ds);
+        TopJob job = {q, op, xcalloc(morsels, sizeof(KeyHeap))};
+        for (int m = 0; m < morsels; m++) {
+            job.heaps[m].keys = xmalloc(op->limit * sizeof(uint64_t));
+            job.heaps[m].limit = op->limit;
+        }
+        run_morsels(ds, top_morsel_task, &job);
+        KeyHeap merged = {xmalloc(op->limit * sizeof(uint64_t)), 0, op->limit};
+        for (int m = 0; m < morsels; m++) {
+            for (int i = 0; i < job.heaps[m].count; i++) {
+                key_heap_push(&merged, job.heaps[m].keys[i]);
+            }
+            free(job.heaps[m].keys);
+        }
+        free(job.heaps);
+        keys = merged.keys;
+        count = merged.count;
+        qsort(keys, count, sizeof(uint64_t), compare_keys);
+    } else {
+        keys = xmalloc((candidates > 0 ? candidates : 1) * sizeof(uint64_t));
+        rank_keys(q, op, 0, selection_words(ds), keys);
+        radix_sort_keys(keys, candidates);
+        count = candidates < op->limit ? candidates : op->limit;
+    }
+    profile_add_bytes((long long)candidates * (sizeof(float) + sizeof(uint64_t)));
+
+    if (op->type == OP_TOP) {
+        fprintf(q->out, "Top %d by %s (%d entries):\n", count, op->field, candidates);
+    } else {
+        fprintf(q->out, "Sorted by %s %s (%d entries):\n", op->field, op->descending ? "descending" : "ascending", candidates);
+    }
+    for (int i = 0; i < count; i++) {
+        int r = (int)(uint32_t)keys[i];
+        fprintf(q->out, "  %d. %s, %s: ", i + 1, string_table_get(&ds->names, ds->county_ids[r]), string_table_get(&ds->names, ds->state_ids[r]));
+        if (field_info[op->field_id].type == COLUMN_FLOAT) {
+            fprintf(q->out, "%.2f\n", column->f[r]);
+        } else {
+            fprintf(q->out, "%d\n", column->i[r]);
+        }
+    }
+    free(keys);
+    return 0;
+}
+
+// Run population-total or population: with or without a state breakdown
+long long run_population_aggregate(Query *q, const Operation *op) {
+    long long *by_state = op->by_state ? xcalloc(q->ds->states.count + 1, sizeof(long long)) : NULL;
+    long long total = op->type == OP_POPULATION_TOTAL ? population_total(q, by_state)
+                                                      : population_field(q, op->field, op->field_id, by_state);
+    free(by_state);
+    return total;
+}
+
+// Run one operation; returns nonzero if the chain must stop with an error
+int run_operation(Query *q, const Operation *op) {
+    switch (op->type) {
+        case OP_DISPLAY:
+            display_counties(q);
+            break;
+        case OP_FILTER_STATE:
+            filter_state(q, op->field);
+            break;
+        case OP_FILTER:
+            filter_field(q, op);
+            break;
+        case OP_POPULATION_TOTAL:
+            run_population_aggregate(q, op);
+            break;
+        case OP_POPULATION:
+            return run_population_aggregate(q, op) < 0;
+        case OP_PERCENT:
+            return percent_sub_population(q, op) != 0;
+        case OP_GROUP_BY:
+            return group_by(q, op) != 0;
+        case OP_TOP:
+        case OP_SORT:
+            return rank_rows(q, op) != 0;
+        case OP_INVALID_FILTER:
+            fprintf(q->err, "Invalid filter operation format. Use: filter:<field>:<ge|le>:<value>\n");
+            return 1;
+        case OP_UNKNOWN:
+            fprintf(q->err, "Unknown operation: %s\n", op->text);
+            return 1;
+    }
+    return 0;
+}
+
+int is_filter_operation(const Operation *op) {
+    return op->type == OP_FILTER || op->type == OP_FILTER_STATE;
+}
+
+// Store in fields the ids of the fields op reads; returns how many
+int operation_fields(const Operation *op, int *fields) {
+    int count = 0;
+    switch (op->type) {
+        case OP_DISPLAY:
+            for (int f = 0; f <= FIELD_POPULATION_2014; f++) {
+                fields[count++] = f;
+            }
+            break;
+        case OP_FILTER:
+        case OP_TOP:
+        case OP_SORT:
+            fields[count++] = op->field_id;
+            break;
+        case OP_GROUP_BY:
+            fields[count++] = op->field_id;
+            fields[count++] = FIELD_POPULATION_2014;
+            break;
+        case OP_POPULATION_TOTAL:
+        case OP_POPULATION:
+        case OP_PERCENT:
+            for (int k = 0; k < op->field_count; k++) {
+                fields[count++] = op->field_ids[k];
+            }
+            fields[count++] = FIELD_POPULATION_2014;
+            break;
+        default:
+            break;
+    }
+    return count;
+}
+
+// Materialize every column the operations read, in one pass over the rows
+int require_operation_fields(const Dataset *ds, const Operation *ops, int count) {
+    int *fields = xmalloc(((size_t)count * (MAX_PERCENT_FIELDS + FIELD_POPULATION_2014 + 1) + 1) * sizeof(int));
+    int field_total = 0;
+    for (int i = 0; i < count; i++) {
+        field_total += operation_fields(&ops[i], fields + field_total);
+    }
+    int built = require_fields(ds, fields, field_total);
+    free(fields);
+    return built;
+}
+
+// Batch mode: a file of pipelines, one per line, each a whitespace
+// separated operation chain. Every pipeline starts from all rows of the
+// one loaded dataset. Selections after each step of a pipeline's leading
+// filters are cached together with the output and errors those steps
+// printed, so pipelines that share a filter prefix replay it instead of
+// rescanning. The cache holds at most PREFIX_CACHE_BYTES; the least
+// recently used entries make room for new ones.
+
+typedef struct {
+    char *key;              // the filter operations, separated by spaces
+    uint64_t *selection;
+    int selected_count;
+    char *output;           // what the filters printed
+    size_t output_length;
+    char *errors;           // and what they reported as errors
+    size_t errors_length;
+    size_t bytes;           // held by the entry
+    unsigned long long used;    // cache clock at the last lookup or insert
+} PrefixCacheEntry;
+
+typedef struct {
+    PrefixCacheEntry *entries;
+    int count;
+    int capacity;
+    size_t bytes;
+    unsigned long long clock;
+} PrefixCache;
+
+const PrefixCacheEntry *prefix_cache_find(PrefixCache *cache, const char *key) {
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->entries[i].key, key) == 0) {
+            cache->entries[i].used = ++cache->clock;
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+void prefix_cache_entry_free(PrefixCacheEntry *entry) {
+    free(entry->key);
+    free(entry->selection);
+    free(entry->output);
+    free(entry->errors);
+}
+
+void prefix_cache_add(PrefixCache *cache, const char *key, const Query *q, const char *output, size_t output_length,
+                      const char *errors, size_t errors_length) {
+    size_t selection_bytes = selection_words(q->ds) * sizeof(uint64_t);
+    size_t bytes = strlen(key) + 1 + selection_bytes + output_length + errors_length;
+    if (bytes > PREFIX_CACHE_BYTES) {
+        return;
+    }
+    while (cache->count > 0 && cache->bytes + bytes > PREFIX_CACHE_BYTES) {
+        int oldest = 0;
+        for (int i = 1; i < cache->count; i++) {
+            oldest = cache->entries[i].used < cache->entries[oldest].used ? i : oldest;
+        }
+        cache->bytes -= cache->entries[oldest].bytes;
+        prefix_cache_entry_free(&cache->entries[oldest]);
+        cache->entries[oldest] = cache->entries[--cache->count];
+    }
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? cache->capacity * 2 : 16;
+        cache->entries = xrealloc(cache->entries, cache->capacity * sizeof(PrefixCacheEntry));
+    }
+    PrefixCacheEntry *entry = &cache->entries[cache->count++];
+    entry->key = strdup(key);
+    entry->selection = xmalloc(selection_bytes);
+    memcpy(entry->selection, q->selection, selection_bytes);
+    entry->selected_count = q->selected_count;
+    entry->output = xmalloc(output_length + 1);
+    memcpy(entry->output, output, output_length);
+    entry->output_length = output_length;
+    entry->errors = xmalloc(errors_length + 1);
+    memcpy(entry->errors, errors, errors_length);
+    entry->errors_length = errors_length;
+    entry->bytes = bytes;
+    entry->used = ++cache->clock;
+    cache->bytes += bytes;
+}
+
+void prefix_cache_free(PrefixCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        prefix_cache_entry_free(&cache->entries[i]);
+    }
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Cache key for the first count operations of a pipeline
+char *prefix_key(const Operation *ops, int count) {
+    size_t length = 1;
+    for (int i = 0; i < count; i++) {
+        length += strlen(ops[i].text) + 1;
+    }
+    char *key = xmalloc(length);
+    key[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        strcat(key, ops[i].text);
+        strcat(key, " ");
+    }
+    return key;
+}
+
+// Run a compiled pipeline on q, reusing and extending the prefix cache
+// (which may be NULL). Returns nonzero if an operation failed.
+int run_pipeline(Query *q, const Operation *ops, int count, PrefixCache *cache) {
+    ProfileMark columns_mark = profile_begin();
+    if (require_operation_fields(q->ds, ops, count) > 0) {
+        profile_end(&columns_mark, "materialize columns", -1, q->ds->row_count);
+    }
+
+    int filters = 0;
+    while (cache && filters < count && is_filter_operation(&ops[filters])) {
+        filters++;
+    }
+
+    // Replay the longest cached filter prefix
+    int done = 0;
+    char *prefix_output = NULL, *prefix_errors = NULL;
+    size_t prefix_length = 0, prefix_errors_length = 0;
+    int rows_before = q->selected_count;
+    ProfileMark replay_mark = profile_begin();
+    for (int n = filters; n > 0; n--) {
+        char *key = prefix_key(ops, n);
+        const PrefixCacheEntry *entry = prefix_cache_find(cache, key);
+        free(key);
+        if (entry) {
+            memcpy(q->selection, entry->selection, selection_words(q->ds) * sizeof(uint64_t));
+            q->selected_count = entry->selected_count;
+            fwrite(entry->output, 1, entry->output_length, q->out);
+            fwrite(entry->errors, 1, entry->errors_length, q->err);
+            prefix_output = xmalloc(entry->output_length + 1);
+            memcpy(prefix_output, entry->output, entry->output_length);
+            prefix_length = entry->output_length;
+            prefix_errors = xmalloc(entry->errors_length + 1);
+            memcpy(prefix_errors, entry->errors, entry->errors_length);
+            prefix_errors_length = entry->errors_length;
+            done = n;
+            break;
+        }
+    }
+    if (done > 0 && profile_mode != PROFILE_OFF) {
+        char *key = prefix_key(ops, done);
+        char *name = xmalloc(strlen(key) + sizeof("(cached)"));
+        sprintf(name, "%s(cached)", key);
+        profile_end(&replay_mark, name, rows_before, q->selected_count);
+        free(name);
+        free(key);
+    }
+
+    // Run the remaining leading filters, caching the selection and the
+    // output and errors printed so far after each one that succeeds; a
+    // failing filter ends the pipeline as it does without a cache
+    int status = 0;
+    for (; done < filters && status == 0; done++) {
+        char *step_output = NULL, *step_errors = NULL;
+        size_t step_length = 0, step_errors_length = 0;
+        FILE *capture = open_memstream(&step_output, &step_length);
+        FILE *capture_errors = capture ? open_memstream(&step_errors, &step_errors_length) : NULL;
+        if (!capture_errors) {
+            if (capture) {
+                fclose(capture);
+                free(step_output);
+            }
+            break;
+        }
+        FILE *out = q->out, *err = q->err;
+        q->out = capture;
+        q->err = capture_errors;
+        int rows_in = q->selected_count;
+        ProfileMark mark = profile_begin();
+        status = run_operation(q, &ops[done]);
+        profile_end(&mark, ops[done].text, rows_in, q->selected_count);
+        q->out = out;
+        q->err = err;
+        fclose(capture);
+        fclose(capture_errors);
+
+        fwrite(step_output, 1, step_length, q->out);
+        fwrite(step_errors, 1, step_errors_length, q->err);
+        prefix_output = xrealloc(prefix_output, prefix_length + step_length + 1);
+        memcpy(prefix_output + prefix_length, step_output, step_length);
+        prefix_length += step_length;
+        prefix_errors = xrealloc(prefix_errors, prefix_errors_length + step_errors_length + 1);
+        memcpy(prefix_errors + prefix_errors_length, step_errors, step_errors_length);
+        prefix_errors_length += step_errors_length;
+        free(step_output);
+        free(step_errors);
+
+        if (status == 0) {
+            char *key = prefix_key(ops, done + 1);
+            prefix_cache_add(cache, key, q, prefix_output, prefix_length, prefix_errors, prefix_errors_length);
+            free(key);
+        }
+    }
+    free(prefix_output);
+    free(prefix_errors);
+
+    // Aggregates in a row share one scan of the selection, made before the
+    // first of them runs, so the first one's profile includes the scan
+    for (int i = done; i < count && status == 0; i++) {
+        int rows_in = q->selected_count;
+        ProfileMark mark = profile_begin();
+        if (is_aggregate_operation(&ops[i]) && !q->fused) {
+            fuse_aggregates(q, &ops[i], count - i);
+        } else if (!is_aggregate_operation(&ops[i]) && q->fused) {
+            aggregate_scan_free(q->fused);
+            q->fused = NULL;
+        }
+        status = run_operation(q, &ops[i]);
+        profile_end(&mark, ops[i].text, rows_in, q->selected_count);
+    }
+    if (q->fused) {
+        aggregate_scan_free(q->fused);
+        q->fused = NULL;
+    }
+    return status != 0;
+}
+
+// Split a whitespace separated operation chain into compiled operations.
+// text is tokenized in place and must outlive the operations.
+Operation *compile_pipeline(char *text, int *count) {
+    int op_count = 0, op_capacity = 8;
+    Operation *ops = xmalloc(op_capacity * sizeof(Operation));
+    char *save = NULL;
+    for (char *token = strtok_r(text, " \t", &save); token; token = strtok_r(NULL, " \t", &save)) {
+        if (op_count == op_capacity) {
+            op_capacity *= 2;
+            ops = xrealloc(ops, op_capacity * sizeof(Operation));
+        }
+        compile_operation(token, &ops[op_count++]);
+    }
+    *count = op_count;
+    return ops;
+}
+
+// Run every pipeline in filename against ds. Blank lines and lines starting
+// with // or # are skipped. Returns nonzero if the file could not be read
+// or any pipeline failed; the pipelines after a failed one still run.
+int run_batch_file(const Dataset *ds, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open batch file %s\n", filename);
+        return 1;
+    }
+
+    PrefixCache cache = {0};
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int pipeline_number = 0;
+    int failed = 0;
+
+    while (getline(&line, &line_capacity, file) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *text = line + strspn(line, " \t");
+        if (*text == '\0' || *text == '#' || strncmp(text, "//", 2) == 0) {
+            continue;
+        }
+        pipeline_number++;
+        printf("Pipeline %d: %s\n", pipeline_number, text);
+
+        // Compile keeps pointers into the line copy
+        char *copy = strdup(text);
+        int op_count;
+        Operation *ops = compile_pipeline(copy, &op_count);
+
+        Query q;
+        query_init(&q, ds, stdout, stderr);
+        failed |= run_pipeline(&q, ops, op_count, &cache);
+        query_free(&q);
+        free(ops);
+        free(copy);
+        fflush(stdout);
+    }
+
+    free(line);
+    prefix_cache_free(&cache);
+    fclose(file);
+    return failed;
+}
+
+// Streaming mode (--stream): the data file is never held in memory as a
+// whole. A reader thread cuts it into batches of up to STREAM_BATCH_ROWS
+// rows and passes them through a bounded queue to compute threads, which
+// parse each batch into a small dataset of its own and run the chain on
+// it. Only filters and the population aggregates can be streamed, since
+// their results combine across batches by adding counts and sums.
+//
+// The chain is split into sections, one per printed result (percent: has
+// two, for its population total and its sub-population). Batches are
+// committed in file order, appending each section's warnings to a spool
+// file, so the final output is the same as without --stream while memory
+// stays bounded by the queue.
+
+#define STREAM_BATCH_ROWS (SCAN_MORSEL_WORDS * 64)
+#define STREAM_READ_SIZE (1 << 20)
+
+typedef enum {
+    SECTION_FILTER,
+    SECTION_POPULATION_TOTAL,
+    SECTION_POPULATION_FIELD
+} StreamSectionKind;
+
+typedef struct {
+    StreamSectionKind kind;
+    const Operation *op;
+    FILE *spool;        // warnings, in line order
+    long long total;    // rows left by a filter, or the population sum
+    int field;          // index into op->fields of a SECTION_POPULATION_FIELD
+    int population_section; // for percent:, the section with its population total
+} StreamSection;
+
+typedef struct {
+    char *text;         // whole lines
+    size_t length;
+    int first_row;
+    long long sequence;
+} StreamBatch;
+
+typedef struct {
+    int fd;
+    char *head;                 // read from fd before the reader started
+    size_t head_length;
+    StreamSection *sections;
+    int section_count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // the queue or next_commit moved
+    StreamBatch *queue;
+    int queue_capacity;
+    int queue_head;
+    int queue_count;
+    int reader_done;
+    long long next_commit;      // sequence of the next batch to commit
+    long long row_count;
+    int read_failed;
+    int sources[MAX_FIELDS];    // from the header, set before the first batch is queued
+    const Operation *ops;       // the operations whose columns each batch needs
+    int op_count;
+} Stream;
+
+void stream_push(Stream *stream, StreamBatch batch) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->queue_count == stream->queue_capacity) {
+        pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    stream->queue[(stream->queue_head + stream->queue_count) % stream->queue_capacity] = batch;
+    stream->queue_count++;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Read the file after its header and queue it in line-aligned batches
+void *stream_reader(void *data) {
+    Stream *stream = data;
+    size_t capacity = STREAM_READ_SIZE > stream->head_length ? STREAM_READ_SIZE : stream->head_length;
+    size_t length = stream->head_length;
+    char *buffer = xmalloc(capacity);
+    if (length > 0) {
+        memcpy(buffer, stream->head, length);
+        profile_add_bytes((long long)length);
+    }
+    int header_skipped = 0, eof = 0;
+    long long rows_before = 0, sequence = 0;
+
+    while (!eof) {
+        if (length == capacity) {
+            // A single line longer than the buffer
+            capacity *= 2;
+            buffer = xrealloc(buffer, capacity);
+        }
+        ssize_t n = read(stream->fd, buffer + length, capacity - length);
+        if (n < 0) {
+            stream->read_failed = 1;
+        }
+        if (n <= 0) {
+            eof = 1;
+        } else {
+            length += (size_t)n;
+            profile_add_bytes(n);
+        }
+
+        // Take every complete line (at the end of the file, every line)
+        const char *p = buffer, *end = buffer + length, *line_end;
+        if (!header_skipped) {
+            const char *header_end = find_line_end(p, end);
+            if (header_end == end && !eof) {
+                continue;
+            }
+            read_header(p, header_end, stream->sources);
+            p = header_end < end ? header_end + 1 : end;
+            header_skipped = 1;
+        }
+        const char *batch_start = p;
+        int rows = 0;
+        for (;;) {
+            int complete = p < end && (eof || find_line_end(p, end) < end);
+            if (rows == STREAM_BATCH_ROWS || (!complete && rows > 0)) {
+                StreamBatch batch = {xmalloc((size_t)(p - batch_start)), (size_t)(p - batch_start), (int)rows_before, sequence++};
+                memcpy(batch.text, batch_start, batch.length);
+                stream_push(stream, batch);
+                rows_before += rows;
+                if (rows_before > INT32_MAX) {
+                    fprintf(stderr, "Error: Too many rows in input\n");
+                    exit(1);
+                }
+                batch_start = p;
+                rows = 0;
+            }
+            if (!complete) {
+                break;
+            }
+            p = next_line(p, end, &line_end);
+            rows++;
+        }
+        length = (size_t)(end - p);
+        memmove(buffer, p, length);
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->reader_done = 1;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Parse batches and run every section on them, committing in file order
+void *stream_worker(void *data) {
+    Stream *stream = data;
+    char **outputs = xcalloc(stream->section_count, sizeof(char *));
+    size_t *output_lengths = xcalloc(stream->section_count, sizeof(size_t));
+    long long *totals = xcalloc(stream->section_count, sizeof(long long));
+
+    for (;;) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->queue_count == 0 && !stream->reader_done) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        if (stream->queue_count == 0) {
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+        StreamBatch batch = stream->queue[stream->queue_head];
+        stream->queue_head = (stream->queue_head + 1) % stream->queue_capacity;
+        stream->queue_count--;
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+
+        Dataset ds = {0};
+        parse_demographics_parallel(&ds, batch.text, batch.text + batch.length);
+        ds.first_row = batch.first_row;
+        dataset_set_sources(&ds, stream->sources);
+        require_operation_fields(&ds, stream->ops, stream->op_count);
+        build_state_index(&ds);
+        free(batch.text);
+
+        Query q;
+        query_init(&q, &ds, NULL, stderr);
+        for (int i = 0; i < stream->section_count; i++) {
+            const StreamSection *section = &stream->sections[i];
+            const Operation *op = section->op;
+            q.out = open_memstream(&outputs[i], &output_lengths[i]);
+            if (!q.out) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(1);
+            }
+            if (section->kind == SECTION_POPULATION_TOTAL) {
+                totals[i] = aggregate_population(&q, NULL, -1, NULL);
+            } else if (section->kind == SECTION_POPULATION_FIELD) {
+                totals[i] = aggregate_population(&q, op->fields[section->field], op->field_ids[section->field], NULL);
+            } else if (op->type == OP_FILTER_STATE) {
+                apply_state_filter(&q, op->field);
+                totals[i] = q.selected_count;
+            } else if (op->field_id >= 0 || op->non_numeric) {
+                apply_field_filter(&q, op);
+                totals[i] = q.selected_count;
+            }
+            fclose(q.out);
+        }
+        query_free(&q);
+
+        pthread_mutex_lock(&stream->lock);
+        while (stream->next_commit != batch.sequence) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        for (int i = 0; i < stream->section_count; i++) {
+            fwrite(outputs[i], 1, output_lengths[i], stream->sections[i].spool);
+            stream->sections[i].total += totals[i];
+            free(outputs[i]);
+        }
+        stream->row_count += ds.row_count;
+        stream->next_commit++;
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+        dataset_free(&ds);
+    }
+
+    free(outputs);
+    free(output_lengths);
+    free(totals);
+    return NULL;
+}
+
+int is_streamable(const Operation *op) {
+    switch (op->type) {
+        case OP_FILTER:
+        case OP_FILTER_STATE:
+            return 1;
+        case OP_POPULATION_TOTAL:
+        case OP_POPULATION:
+        case OP_PERCENT:
+            return !op->by_state;
+        default:
+            return 0;
+    }
+}
+
+// Index of the first unknown field of population: or percent:, or -1
+int first_invalid_field(const Operation *op) {
+    for (int f = 0; (op->type == OP_POPULATION || op->type == OP_PERCENT) && f < op->field_count; f++) {
+        if (op->field_ids[f] < 0) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+// Whether the chain stops with an error at op, as run_operation would
+int stops_chain(const Operation *op) {
+    return op->type == OP_INVALID_FILTER || op->type == OP_UNKNOWN || first_invalid_field(op) >= 0;
+}
+
+// Run a chain of filters and population aggregates over filename without
+// loading it. fd, unless -1, is filename as preread_stream_input opened
+// it, with the head_length bytes it read in head; both are released here.
+// Returns nonzero on failure or if an operation failed.
+int stream_operations(const char *filename, int fd, char *head, size_t head_length, const Operation *ops, int count) {
+    ProfileMark mark = profile_begin();
+    // Everything up to the first failing operation is streamed
+    int streamed = 0;
+    while (streamed < count && !stops_chain(&ops[streamed])) {
+        if (!is_streamable(&ops[streamed])) {
+            fprintf(stderr, "Error: --stream supports only filter:, filter-state:, population-total, population: and percent: (got %s)\n", ops[streamed].text);
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(head);
+            return 1;
+        }
+        streamed++;
+    }
+
+    if (fd < 0) {
+        fd = open(filename, O_RDONLY);
+    }
+    if (fd < 0) {
+        // The operations still run, over no rows, as they do without --stream
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        Dataset empty = {0};
+        dataset_init_empty(&empty);
+        Query q;
+        query_init(&q, &empty, stdout, stderr);
+        int status = run_pipeline(&q, ops, count, NULL);
+        query_free(&q);
+        dataset_free(&empty);
+        return status;
+    }
+    char magic[8];
+    if (head ? head_length >= sizeof(magic) && memcmp(head, SNAPSHOT_MAGIC, 8) == 0
+             : pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, 8) == 0) {
+        fprintf(stderr, "Error: --stream reads CSV files, not snapshots\n");
+        close(fd);
+        free(head);
+        return 1;
+    }
+
+    // A failing percent: still prints its population total and the
+    // fields before the failing one
+    Stream stream = {0};
+    stream.fd = fd;
+    stream.head = head;
+    stream.head_length = head_length;
+    stream.ops = ops;
+    stream.op_count = streamed < count ? streamed + 1 : count;
+    stream.sections = xcalloc((size_t)count * (MAX_PERCENT_FIELDS + 1) + 1, sizeof(StreamSection));
+    for (int i = 0; i <= streamed && i < count; i++) {
+        const Operation *op = &ops[i];
+        if (i == streamed && op->type != OP_PERCENT) {
+            break;
+        }
+        if (op->type == OP_FILTER || op->type == OP_FILTER_STATE) {
+            stream.sections[stream.section_count++] = (StreamSection){.kind = SECTION_FILTER, .op = op};
+        }
+        int population_section = stream.section_count;
+        if (op->type == OP_POPULATION_TOTAL || op->type == OP_PERCENT) {
+            stream.sections[stream.section_count++] = (StreamSection){.kind = SECTION_POPULATION_TOTAL, .op = op};
+        }
+        for (int f = 0; (op->type == OP_POPULATION || op->type == OP_PERCENT) && f < op->field_count; f++) {
+            if (op->field_ids[f] < 0) {
+                break;
+            }
+            stream.sections[stream.section_count++] = (StreamSection){.kind = SECTION_POPULATION_FIELD, .op = op,
+                                                                      .field = f, .population_section = population_section};
+        }
+    }
+    for (int i = 0; i < stream.section_count; i++) {
+        stream.sections[i].spool = tmpfile();
+        if (!stream.sections[i].spool) {
+            fprintf(stderr, "Error: Could not create a temporary file\n");
+            exit(1);
+        }
+    }
+
+    // Create the shared pool before the threads that use it
+    get_thread_pool();
+    int workers = configured_thread_count();
+    stream.queue_capacity = 2 * workers;
+    stream.queue = xcalloc(stream.queue_capacity, sizeof(StreamBatch));
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+
+    pthread_t reader;
+    pthread_t *threads = xcalloc(workers, sizeof(pthread_t));
+    if (pthread_create(&reader, NULL, stream_reader, &stream) != 0) {
+        fprintf(stderr, "Error: Could not start the reader thread\n");
+        exit(1);
+    }
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        started += pthread_create(&threads[started], NULL, stream_worker, &stream) == 0;
+    }
+    if (started == 0) {
+        stream_worker(&stream);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(reader, NULL);
+    close(fd);
+    free(head);
+    free(threads);
+    free(stream.queue);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.changed);
+
+    if (stream.read_failed) {
+        fprintf(stderr, "Error: Could not read file %s\n", filename);
+    }
+    printf("%lld entries loaded successfully.\n", stream.row_count);
+
+    // Print each section's warnings followed by its result
+    for (int i = 0; i < stream.section_count; i++) {
+        StreamSection *section = &stream.sections[i];
+        const Operation *op = section->op;
+        char buffer[1 << 16];
+        size_t n;
+        rewind(section->spool);
+        while ((n = fread(buffer, 1, sizeof(buffer), section->spool)) > 0) {
+            fwrite(buffer, 1, n, stdout);
+        }
+        fclose(section->spool);
+
+        if (section->kind == SECTION_POPULATION_TOTAL) {
+            print_population_total(stdout, section->total);
+        } else if (section->kind == SECTION_POPULATION_FIELD) {
+            print_population_field(stdout, op->fields[section->field], section->total);
+            if (op->type == OP_PERCENT) {
+                print_percentage(stdout, op->fields[section->field], stream.sections[section->population_section].total, section->total);
+            }
+        } else if (op->type == OP_FILTER_STATE) {
+            print_state_filter(stdout, op->field, (int)section->total);
+        } else if (op->field_id >= 0 || op->non_numeric) {
+            print_field_filter(stdout, op, (int)section->total);
+        } else {
+            fprintf(stderr, "Error: Unsupported field '%s'\n", op->field);
+        }
+    }
+    free(stream.sections);
+
+    // Report the failing operation, if any, the way a normal run does
+    int status = stream.read_failed;
+    if (streamed < count) {
+        Dataset empty = {0};
+        dataset_init_empty(&empty);
+        require_operation_fields(&empty, &ops[streamed], 1);
+        Query q;
+        query_init(&q, &empty, stdout, stderr);
+        if (ops[streamed].type == OP_PERCENT) {
+            int f = first_invalid_field(&ops[streamed]);
+            population_field(&q, ops[streamed].fields[f], -1, NULL);
+        } else {
+            run_operation(&q, &ops[streamed]);
+        }
+        query_free(&q);
+        dataset_free(&empty);
+        status = 1;
+    }
+    profile_end(&mark, "stream", -1, stream.row_count);
+    return status;
+}
+
+// Query server: the data is loaded once and pipelines are answered over a
+// Unix socket or a localhost TCP port. A request is one line holding an
+// operation chain; the reply is everything the chain printed, errors
+// included, followed by "END <status>". The line "reload" forces the data
+// file to be reloaded and "quit" closes the connection.
+//
+// Connections are handed to a fixed set of worker threads that share one
+// read-only dataset. A watcher thread reloads the data file when it
+// changes and swaps the new dataset in; requests already running keep the
+// old one until they finish, and a failed reload keeps serving the old one.
+// Served datasets hold a copy of the file rather than a mapping, so their
+// columns can still be parsed on first use after the file has changed.
+//
+// With --incremental a reload only parses the regions of the file that
+// changed since it was loaded: the file is kept as line-aligned blocks
+// with checksums, and blocks found unchanged in the new text (possibly
+// moved by edits before them) keep their rows, while the text between
+// them is parsed again. The result holds the rows of the new file in file
+// order, as a full load would, and only the columns already materialized
+// are carried over. A file whose header changed is loaded in full.
+
+// The blocks of a loaded data file. The header is checksummed on its own;
+// block b is [starts[b], starts[b + 1]), and starts[count] is the size.
+typedef struct {
+    size_t size;
+    size_t header_size;     // terminator included
+    uint64_t header_sum;
+    int ends_in_newline;    // otherwise the last line may be continued by appended text
+    int count;
+    size_t *starts;
+    int *rows_before;       // data rows before each block (and in total)
+    uint64_t *sums;
+} FileBlocks;
+
+typedef struct {
+    Dataset ds;
+    int refs; // the server's reference plus one per running request
+} SharedDataset;
+
+typedef struct {
+    const char *data_file;
+    pthread_mutex_t lock;           // guards current and every refs
+    SharedDataset *current;
+    pthread_mutex_t reload_lock;    // one reload at a time
+    struct stat loaded_stat;        // of data_file when current was loaded
+    int incremental;
+    FileBlocks blocks;              // of data_file as current was loaded, if incremental
+    pthread_mutex_t queue_lock;     // accepted connections awaiting a worker
+    pthread_cond_t queue_ready;
+    pthread_cond_t queue_space;
+    int queue[SERVER_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+} Server;
+
+volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int sig) {
+    (void)sig;
+    server_stopping = 1;
+}
+
+SharedDataset *server_acquire(Server *server) {
+    pthread_mutex_lock(&server->lock);
+    SharedDataset *shared = server->current;
+    shared->refs++;
+    pthread_mutex_unlock(&server->lock);
+    return shared;
+}
+
+void server_release(Server *server, SharedDataset *shared) {
+    pthread_mutex_lock(&server->lock);
+    int last = --shared->refs == 0;
+    pthread_mutex_unlock(&server->lock);
+    if (last) {
+        dataset_free(&shared->ds);
+        free(shared);
+    }
+}
+
+int same_file_version(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+uint64_t checksum_bytes(const void *data, size_t length) {
+    Checksum sum = {0};
+    checksum_update(&sum, data, length);
+    return checksum_final(&sum);
+}
+
+void file_blocks_free(FileBlocks *blocks) {
+    free(blocks->starts);
+    free(blocks->rows_before);
+    free(blocks->sums);
+    memset(blocks, 0, sizeof(*blocks));
+}
+
+// Start an empty block list for a file of size bytes with room for
+// capacity blocks
+void file_blocks_init(FileBlocks *blocks, const char *data, size_t size, size_t capacity) {
+    const char *header_end = find_line_end(data, data + size);
+    blocks->size = size;
+    blocks->header_size = header_end < data + size ? (size_t)(header_end + 1 - data) : size;
+    blocks->header_sum = checksum_bytes(data, blocks->header_size);
+    blocks->ends_in_newline = size > 0 && data[size - 1] == '\n';
+    blocks->count = 0;
+    blocks->starts = xmalloc((capacity + 1) * sizeof(size_t));
+    blocks->rows_before = xmalloc((capacity + 1) * sizeof(int));
+    blocks->sums = xmalloc((capacity > 0 ? capacity : 1) * sizeof(uint64_t));
+    blocks->starts[0] = blocks->header_size;
+    blocks->rows_before[0] = 0;
+}
+
+// Blocks file_blocks_split makes of length bytes at most
+size_t file_blocks_needed(size_t length) {
+    return length / RELOAD_BLOCK_SIZE + 1;
+}
+
+// Append blocks of about RELOAD_BLOCK_SIZE bytes that end at line ends,
+// checksummed, covering [start, end) of data
+void file_blocks_split(FileBlocks *blocks, const char *data, size_t start, size_t end) {
+    const char *p = data + start, *stop = data + end;
+    while (p < stop) {
+        const char *block_end = stop;
+        if ((size_t)(stop - p) > RELOAD_BLOCK_SIZE) {
+            block_end = find_line_end(p + RELOAD_BLOCK_SIZE, stop);
+            block_end += block_end < stop;
+        }
+        int b = blocks->count++;
+        blocks->starts[b] = (size_t)(p - data);
+        blocks->sums[b] = checksum_bytes(p, (size_t)(block_end - p));
+        blocks->rows_before[b + 1] = blocks->rows_before[b] + count_data_lines(p, block_end);
+        blocks->starts[b + 1] = (size_t)(block_end - data);
+        p = block_end;
+    }
+}
+
+// Split a CSV file into blocks and checksum them
+void file_blocks_build(FileBlocks *blocks, const char *data, size_t size) {
+    file_blocks_free(blocks);
+    file_blocks_init(blocks, data, size, file_blocks_needed(size));
+    file_blocks_split(blocks, data, blocks->header_size, size);
+    blocks->starts[blocks->count] = size;
+}
+
+// Get a freshly loaded dataset ready to serve: remember the blocks of the
+// text it came from
+void server_prepare(Server *server, Dataset *ds) {
+    if (server->incremental) {
+        if (ds->text_data) {
+            file_blocks_build(&server->blocks, ds->text_data, ds->text_size);
+        } else {
+            file_blocks_free(&server->blocks);
+        }
+    }
+}
+
+void server_swap(Server *server, SharedDataset *fresh) {
+    fresh->refs = 1;
+    pthread_mutex_lock(&server->lock);
+    SharedDataset *old = server->current;
+    server->current = fresh;
+    pthread_mutex_unlock(&server->lock);
+    server_release(server, old);
+}
+
+// Whether old block b is in text, at shift bytes from where it was, at the
+// start of a line. The last block of a file that did not end in a newline
+// must still end the file.
+int file_block_matches(const FileBlocks *blocks, int b, const char *text, size_t size, long long shift) {
+    long long start = (long long)blocks->starts[b] + shift;
+    long long end = (long long)blocks->starts[b + 1] + shift;
+    if (start < (long long)blocks->header_size || end > (long long)size || text[start - 1] != '\n') {
+        return 0;
+    }
+    if (b == blocks->count - 1 && !blocks->ends_in_newline && end != (long long)size) {
+        return 0;
+    }
+    return checksum_bytes(text + start, (size_t)(end - start)) == blocks->sums[b];
+}
+
+// Which old blocks are unchanged at shift 0 and at the change in file
+// size, the only two shifts a reload looks for them at
+typedef struct {
+    const FileBlocks *blocks;
+    const char *text;
+    size_t size;
+    long long total_shift;
+    char *unmoved;
+    char *moved;
+} BlockMatchJob;
+
+void block_match_task(void *arg, int b) {
+    BlockMatchJob *job = arg;
+    job->unmoved[b] = file_block_matches(job->blocks, b, job->text, job->size, 0);
+    job->moved[b] = job->total_shift != 0 && file_block_matches(job->blocks, b, job->text, job->size, job->total_shift);
+}
+
+// Changed text of a reloaded file, [start, end), the old blocks
+// [first_block, end_block) and rows of the current dataset
+// [old_first, old_end) it replaces
+typedef struct {
+    size_t start, end;
+    int first_block, end_block;
+    int old_first, old_end;
+    long long shift;        // how far the unchanged text after it moved
+    Dataset rows;           // the text parsed
+} ReloadRegion;
+
+// A run of rows of the reloaded dataset, taken from old_first on in the
+// current dataset or, when old_first is -1, from a region
+typedef struct {
+    int first_row;
+    int row_count;
+    int old_first;
+    const ReloadRegion *region;
+} ReloadRun;
+
+// A row of a changed region, for matching removed and added rows by key
+typedef struct {
+    uint64_t key;
+    int order;
+    const char *fields;     // the text after the State field
+    const char *text_end;
+} ReloadKey;
+
+int compare_reload_keys(const void *a, const void *b) {
+    const ReloadKey *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+// Whether two rows have the same text after their State fields
+int same_row_fields(const ReloadKey *a, const ReloadKey *b) {
+    const char *a_end = find_line_end(a->fields, a->text_end), *b_end = find_line_end(b->fields, b->text_end);
+    a_end -= a_end > a->fields && a_end[-1] == '\r';
+    b_end -= b_end > b->fields && b_end[-1] == '\r';
+    return a_end - a->fields == b_end - b->fields && memcmp(a->fields, b->fields, (size_t)(a_end - a->fields)) == 0;
+}
+
+// Bring the current dataset up to date with the data file, parsing only
+// the text that changed. Returns -1 if the file has to be loaded in full
+// instead.
+int server_apply_changes(Server *server) {
+    FileBlocks *blocks = &server->blocks;
+    MappedFile file;
+    if (!blocks->starts || map_file(server->data_file, &file, 1) != 0) {
+        return -1;
+    }
+    const char *text = file.data;
+    if (is_snapshot(&file) || file.size < blocks->header_size ||
+        checksum_bytes(text, blocks->header_size) != blocks->header_sum) {
+        unmap_file(&file);
+        return -1;
+    }
+
+    // Walk the old blocks following how far the unchanged text has moved.
+    // A run of changed blocks ends at the next block found unchanged,
+    // either where the text before it left it or where the change in file
+    // size puts it; text after the last block is new.
+    long long total_shift = (long long)file.size - (long long)blocks->size;
+    BlockMatchJob match = {blocks, text, file.size, total_shift, xmalloc(blocks->count + 1), xmalloc(blocks->count + 1)};
+    thread_pool_run(get_thread_pool(), blocks->count, block_match_task, &match);
+    long long shift = 0;
+    ReloadRegion *regions = xcalloc(blocks->count + 1, sizeof(ReloadRegion));
+    int region_count = 0;
+    int reached_end = 0;
+    for (int b = 0; b < blocks->count;) {
+        if (shift == 0 ? match.unmoved[b] : match.moved[b]) {
+            b++;
+            continue;
+        }
+        ReloadRegion *region = &regions[region_count++];
+        region->start = (size_t)((long long)blocks->starts[b] + shift);
+        region->first_block = b;
+        region->old_first = blocks->rows_before[b];
+        int next = b + 1;
+        for (; next < blocks->count; next++) {
+            if (shift == 0 ? match.unmoved[next] : match.moved[next]) {
+                break;
+            }
+            if (shift == 0 && match.moved[next] && (long long)blocks->starts[next] + total_shift >= (long long)region->start) {
+                shift = total_shift;
+                break;
+            }
+        }
+        reached_end = next == blocks->count;
+        region->end = reached_end ? file.size : (size_t)((long long)blocks->starts[next] + shift);
+        region->end_block = next;
+        region->old_end = blocks->rows_before[next];
+        region->shift = shift;
+        b = next;
+    }
+    free(match.unmoved);
+    free(match.moved);
+    size_t tail = (size_t)((long long)blocks->size + shift);
+    if (!reached_end && tail < file.size) {
+        int rows = blocks->rows_before[blocks->count];
+        regions[region_count++] = (ReloadRegion){.start = tail, .end = file.size,
+                                                 .first_block = blocks->count, .end_block = blocks->count,
+                                                 .old_first = rows, .old_end = rows, .shift = shift};
+    }
+    if (region_count == 0) {
+        free(regions);
+        unmap_file(&file);
+        return 0;
+    }
+
+    SharedDataset *current = server_acquire(server);
+    const Dataset *old = &current->ds;
+    if (!old->row_fields || !old->text_data) {
+        server_release(server, current);
+        free(regions);
+        unmap_file(&file);
+        return -1;
+    }
+
+    // Parse the regions, with the columns already materialized
+    int sources[MAX_FIELDS];
+    read_header(text, find_line_end(text, text + file.size), sources);
+    int ready[MAX_FIELDS], ready_count = 0;
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (old->columns[f].present && atomic_load_explicit(&old->columns[f].ready, memory_order_acquire)) {
+            ready[ready_count++] = f;
+        }
+    }
+    long long row_count = old->row_count;
+    for (int i = 0; i < region_count; i++) {
+        parse_demographics_parallel(&regions[i].rows, text + regions[i].start, text + regions[i].end);
+        dataset_set_sources(&regions[i].rows, sources);
+        require_fields(&regions[i].rows, ready, ready_count);
+        row_count += regions[i].rows.row_count - (regions[i].old_end - regions[i].old_first);
+    }
+    if (row_count > INT32_MAX) {
+        fprintf(stderr, "Error: Too many rows in input\n");
+        exit(1);
+    }
+
+    // The new dataset's names extend the current ones, so old rows keep
+    // their ids. Region rows are given ids in it in place.
+    SharedDataset *fresh = xcalloc(1, sizeof(SharedDataset));
+    Dataset *ds = &fresh->ds;
+    for (uint32_t id = 0; id < old->names.count; id++) {
+        string_table_intern(&ds->names, old->names.strings[id], old->names.lengths[id]);
+    }
+    int removed_count = 0, added_count = 0;
+    for (int i = 0; i < region_count; i++) {
+        Dataset *rows = &regions[i].rows;
+        for (int r = 0; r < rows->row_count; r++) {
+            uint32_t county = rows->county_ids[r], state = rows->state_ids[r];
+            rows->county_ids[r] = string_table_intern(&ds->names, rows->names.strings[county], rows->names.lengths[county]);
+            rows->state_ids[r] = string_table_intern(&ds->names, rows->names.strings[state], rows->names.lengths[state]);
+        }
+        removed_count += regions[i].old_end - regions[i].old_first;
+        added_count += rows->row_count;
+    }
+
+    // Match the rows the regions replace with their new rows by key, in
+    // order among rows with the same key. A key that keeps its text is
+    // not counted.
+    ReloadKey *removed = xmalloc((removed_count + 1) * sizeof(ReloadKey));
+    ReloadKey *added = xmalloc((added_count + 1) * sizeof(ReloadKey));
+    removed_count = added_count = 0;
+    for (int i = 0; i < region_count; i++) {
+        const Dataset *rows = &regions[i].rows;
+        for (int r = regions[i].old_first; r < regions[i].old_end; r++) {
+            removed[removed_count] = (ReloadKey){row_key(old, r), removed_count, old->row_fields[r], old->text_end};
+            removed_count++;
+        }
+        for (int r = 0; r < rows->row_count; r++) {
+            added[added_count] = (ReloadKey){row_key(rows, r), added_count, rows->row_fields[r], rows->text_end};
+            added_count++;
+        }
+    }
+    qsort(removed, removed_count, sizeof(ReloadKey), compare_reload_keys);
+    qsort(added, added_count, sizeof(ReloadKey), compare_reload_keys);
+    int updated = 0, appeared = 0, disappeared = 0;
+    for (int i = 0, j = 0; i < removed_count || j < added_count;) {
+        if (j == added_count || (i < removed_count && removed[i].key < added[j].key)) {
+            disappeared++;
+            i++;
+        } else if (i == removed_count || added[j].key < removed[i].key) {
+            appeared++;
+            j++;
+        } else {
+            updated += !same_row_fields(&removed[i], &added[j]);
+            i++;
+            j++;
+        }
+    }
+    free(removed);
+    free(added);
+
+    // Lay out the rows in file order: unchanged rows point at their moved
+    // text, region rows at the text they were parsed from
+    dataset_allocate(ds, (int)row_count);
+    dataset_set_sources(ds, sources);
+    ds->text_data = text;
+    ds->text_size = file.size;
+    ds->text_mapped = file.mapped;
+    ds->text_end = text + file.size;
+    ReloadRun *runs = xmalloc((2 * region_count + 1) * sizeof(ReloadRun));
+    int run_count = 0;
+    int row = 0, old_row = 0;
+    for (int i = 0; i <= region_count; i++) {
+        int old_end = i < region_count ? regions[i].old_first : old->row_count;
+        long long moved = i > 0 ? regions[i - 1].shift : 0;
+        if (old_end > old_row) {
+            runs[run_count++] = (ReloadRun){row, old_end - old_row, old_row, NULL};
+            for (; old_row < old_end; old_row++, row++) {
+                ds->county_ids[row] = old->county_ids[old_row];
+                ds->state_ids[row] = old->state_ids[old_row];
+                ds->row_fields[row] = text + (old->row_fields[old_row] - (const char *)old->text_data) + moved;
+            }
+        }
+        if (i == region_count) {
+            break;
+        }
+        const Dataset *rows = &regions[i].rows;
+        if (rows->row_count > 0) {
+            runs[run_count++] = (ReloadRun){row, rows->row_count, -1, &regions[i]};
+        }
+        memcpy(ds->county_ids + row, rows->county_ids, rows->row_count * sizeof(uint32_t));
+        memcpy(ds->state_ids + row, rows->state_ids, rows->row_count * sizeof(uint32_t));
+        memcpy(ds->row_fields + row, rows->row_fields, rows->row_count * sizeof(const char *));
+        row += rows->row_count;
+        old_row = regions[i].old_end;
+    }
+
+    // Zones holding only rows that kept their place keep their zone maps
+    size_t zones = zone_count(ds), old_zones = zone_count(old);
+    uint64_t *dirty = xcalloc(BITMAP_WORDS(zones), sizeof(uint64_t));
+    for (int i = 0; i < run_count; i++) {
+        if (runs[i].old_first == runs[i].first_row) {
+            continue;
+        }
+        for (size_t z = runs[i].first_row / ZONE_ROWS; z <= (size_t)(runs[i].first_row + runs[i].row_count - 1) / ZONE_ROWS; z++) {
+            dirty[z / 64] |= 1ULL << (z & 63);
+        }
+    }
+    if (ds->row_count != old->row_count) {
+        int common = ds->row_count < old->row_count ? ds->row_count : old->row_count;
+        for (size_t z = common / ZONE_ROWS; z < zones; z++) {
+            dirty[z / 64] |= 1ULL << (z & 63);
+        }
+    }
+
+    size_t padded_rows = selection_words(ds) * 64;
+    for (int k = 0; k < ready_count; k++) {
+        int f = ready[k];
+        Column *to = &ds->columns[f];
+        to->f = xcalloc(padded_rows, sizeof(float));
+        to->valid = xcalloc(padded_rows / 64, sizeof(uint64_t));
+        to->zone_min.f = xmalloc(zones * sizeof(float));
+        to->zone_max.f = xmalloc(zones * sizeof(float));
+        to->owned = to->zones_owned = 1;
+        for (int i = 0; i < run_count; i++) {
+            const Column *from = runs[i].region ? &runs[i].region->rows.columns[f] : &old->columns[f];
+            int from_row = runs[i].region ? 0 : runs[i].old_first;
+            memcpy(to->i + runs[i].first_row, from->i + from_row, runs[i].row_count * sizeof(int32_t));
+            bitmap_copy(to->valid, runs[i].first_row, from->valid, from_row, runs[i].row_count);
+        }
+        for (size_t z = 0; z < zones; z++) {
+            if (z >= old_zones || bitmap_test(dirty, (int)z)) {
+                build_zone(ds, f, z);
+            } else {
+                to->zone_min.i[z] = old->columns[f].zone_min.i[z];
+                to->zone_max.i[z] = old->columns[f].zone_max.i[z];
+            }
+        }
+        atomic_store(&to->ready, 1);
+    }
+
+    // Rows appended after every old row extend the state index
+    if (region_count == 1 && regions[0].old_first == old->row_count) {
+        extend_state_index(ds, old);
+    } else {
+        build_state_index(ds);
+    }
+
+    server_release(server, current);
+    server_swap(server, fresh);
+    printf("%d entries updated, %d added and %d removed in %s.\n", updated, appeared, disappeared, server->data_file);
+
+    // Unchanged blocks keep their checksums; only the regions are split
+    // into blocks and checksummed again
+    size_t capacity = blocks->count;
+    for (int i = 0; i < region_count; i++) {
+        capacity += file_blocks_needed(regions[i].end - regions[i].start);
+    }
+    FileBlocks next = {0};
+    file_blocks_init(&next, text, file.size, capacity);
+    for (int i = 0, b = 0; i <= region_count; i++) {
+        int end_block = i < region_count ? regions[i].first_block : blocks->count;
+        long long moved = i > 0 ? regions[i - 1].shift : 0;
+        for (; b < end_block; b++) {
+            int k = next.count++;
+            next.starts[k] = (size_t)((long long)blocks->starts[b] + moved);
+            next.sums[k] = blocks->sums[b];
+            next.rows_before[k + 1] = next.rows_before[k] + blocks->rows_before[b + 1] - blocks->rows_before[b];
+        }
+        if (i < region_count) {
+            file_blocks_split(&next, text, regions[i].start, regions[i].end);
+            b = regions[i].end_block;
+        }
+    }
+    next.starts[next.count] = file.size;
+    file_blocks_free(blocks);
+    *blocks = next;
+
+    for (int i = 0; i < region_count; i++) {
+        dataset_free(&regions[i].rows);
+    }
+    free(regions);
+    free(runs);
+    free(dirty);
+    return 0;
+}
+
+// Load the data file again and swap it in. Unless forced, nothing happens
+// when the file is unchanged since the last load. Returns nonzero if the
+// file could not be loaded; the previous dataset stays in use then.
+int server_reload(Server *server, int force) {
+    pthread_mutex_lock(&server->reload_lock);
+    struct stat st;
+    int status = 0;
+    if (stat(server->data_file, &st) != 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", server->data_file);
+        status = -1;
+    } else if (force || !same_file_version(&st, &server->loaded_stat)) {
+        if (!server->incremental || server_apply_changes(server) != 0) {
+            SharedDataset *fresh = xcalloc(1, sizeof(SharedDataset));
+            if (parse_demographics_file(&fresh->ds, server->data_file, NULL, 1) != 0) {
+                free(fresh);
+                status = -1;
+            } else {
+                server_prepare(server, &fresh->ds);
+                server_swap(server, fresh);
+            }
+        }
+        // Remember this version even if it failed so it is not retried
+        // every poll; the next change to the file triggers another attempt
+        server->loaded_stat = st;
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&server->reload_lock);
+    return status;
+}
+
+// Reload once the data file has changed and then stayed the same for a
+// whole poll interval, so a file still being written is not picked up
+void *server_watch(void *data) {
+    Server *server = data;
+    struct stat previous = server->loaded_stat;
+    for (;;) {
+        sleep(SERVER_POLL_SECONDS);
+        struct stat st;
+        if (stat(server->data_file, &st) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&server->reload_lock);
+        int changed = !same_file_version(&st, &server->loaded_stat);
+        pthread_mutex_unlock(&server->reload_lock);
+        if (changed && same_file_version(&st, &previous)) {
+            server_reload(server, 0);
+        }
+        previous = st;
+    }
+    return NULL;
+}
+
+// Answer requests on one connection until the client quits or hangs up
+void serve_connection(Server *server, int fd) {
+    int out_fd = dup(fd);
+    if (out_fd < 0) {
+        close(fd);
+        return;
+    }
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(out_fd, "w");
+    if (!in || !out) {
+        fprintf(stderr, "Error: Could not open connection streams\n");
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, in) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *text = line + strspn(line, " \t");
+        if (strcmp(text, "quit") == 0) {
+            break;
+        }
+
+        int status;
+        if (strcmp(text, "reload") == 0) {
+            status = server_reload(server, 1) != 0;
+            if (status == 0) {
+                fprintf(out, "Reloaded %s\n", server->data_file);
+            }
+        } else {
+            SharedDataset *shared = server_acquire(server);
+            int op_count;
+            Operation *ops = compile_pipeline(text, &op_count);
+            Query q;
+            query_init(&q, &shared->ds, out, out);
+            status = run_pipeline(&q, ops, op_count, NULL);
+            query_free(&q);
+            free(ops);
+            server_release(server, shared);
+        }
+        fprintf(out, "END %d\n", status);
+        if (fflush(out) != 0) {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
+void *server_worker(void *data) {
+    Server *server = data;
+    for (;;) {
+        pthread_mutex_lock(&server->queue_lock);
+        while (server->queue_count == 0) {
+            pthread_cond_wait(&server->queue_ready, &server->queue_lock);
+        }
+        int fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVER_QUEUE_SIZE;
+        server->queue_count--;
+        pthread_cond_signal(&server->queue_space);
+        pthread_mutex_unlock(&server->queue_lock);
+
+        serve_connection(server, fd);
+    }
+    return NULL;
+}
+
+// Open a listening socket for "unix:PATH", "tcp:PORT" (localhost only) or
+// a bare PATH. Returns the socket, or -1 after printing an error.
+int open_listener(const char *address) {
+    int fd;
+    if (strncmp(address, "tcp:", 4) == 0) {
+        char *end;
+        long port = strtol(address + 4, &end, 10);
+        if (end == address + 4 || *end != '\0' || port < 1 || port > 65535) {
+            fprintf(stderr, "Error: Invalid port in %s\n", address);
+            return -1;
+        }
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            goto fail;
+        }
+    } else {
+        const char *path = strncmp(address, "unix:", 5) == 0 ? address + 5 : address;
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        if (*path == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: Invalid socket path %s\n", path);
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        // Replace a socket left behind by an earlier server, but nothing else
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            goto fail;
+        }
+    }
+    if (listen(fd, SERVER_QUEUE_SIZE) != 0) {
+        goto fail;
+    }
+    return fd;
+
+fail:
+    fprintf(stderr, "Error: Could not listen on %s: %s\n", address, strerror(errno));
+    if (fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+// Serve queries on ds, which the server takes over, until interrupted.
+// With incremental set, reloads apply only what changed (see above).
+int run_server(Dataset *ds, const char *data_file, const char *address, int incremental) {
+    int listener = open_listener(address);
+    if (listener < 0) {
+        return 1;
+    }
+
+    Server *server = xcalloc(1, sizeof(Server));
+    server->data_file = data_file;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_mutex_init(&server->reload_lock, NULL);
+    pthread_mutex_init(&server->queue_lock, NULL);
+    pthread_cond_init(&server->queue_ready, NULL);
+    pthread_cond_init(&server->queue_space, NULL);
+    server->incremental = incremental;
+    server_prepare(server, ds);
+    server->current = xcalloc(1, sizeof(SharedDataset));
+    server->current->ds = *ds;
+    server->current->refs = 1;
+    memset(ds, 0, sizeof(*ds));
+    stat(data_file, &server->loaded_stat);
+
+    // A client hanging up mid-reply must not kill the server. The stop
+    // signals are blocked in every other thread, so they reach this one,
+    // and it only lets them through while pselect() waits for a client:
+    // one arriving just before the wait still ends it.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop = {0};
+    stop.sa_handler = server_stop;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    sigset_t stop_signals, waiting;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &waiting);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
+
+    pthread_t thread;
+    int workers = configured_thread_count();
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&thread, NULL, server_worker, server) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    if (pthread_create(&thread, NULL, server_watch, server) == 0) {
+        pthread_detach(thread);
+    }
+
+    printf("Serving %s on %s\n", data_file, address);
+    fflush(stdout);
+
+    while (!server_stopping) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        if (pselect(listener + 1, &readable, NULL, NULL, NULL, &waiting) <= 0) {
+            continue;
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&server->queue_lock);
+        while (server->queue_count == SERVER_QUEUE_SIZE) {
+            pthread_cond_wait(&server->queue_space, &server->queue_lock);
+        }
+        server->queue[(server->queue_head + server->queue_count) % SERVER_QUEUE_SIZE] = fd;
+        server->queue_count++;
+        pthread_cond_signal(&server->queue_ready);
+        pthread_mutex_unlock(&server->queue_lock);
+    }
+
+    // Workers may still be mid-request, so leave the dataset to process exit
+    close(listener);
+    if (strncmp(address, "tcp:", 4) != 0) {
+        unlink(strncmp(address, "unix:", 5) == 0 ? address + 5 : address);
+    }
+    return 0;
+}
+
+// Synthetic data (--generate). Rows have the shape of county_demographics.csv:
+// the real header, real state abbreviations and values in roughly the ranges
+// of the real file. A given row count always produces the same file.
+
+static const char demographics_header[] =
+    "\"County\",\"State\",\"Age.Percent 65 and Older\",\"Age.Percent Under 18 Years\",\"Age.Percent Under 5 Years\","
+    "\"Education.Bachelor's Degree or Higher\",\"Education.High School or Higher\",\"Employment.Nonemployer Establishments\","
+    "\"Employment.Private Non-farm Employment\",\"Employment.Private Non-farm Employment Percent Change\","
+    "\"Employment.Private Non-farm Establishments\",\"Ethnicities.American Indian and Alaska Native Alone\","
+    "\"Ethnicities.Asian Alone\",\"Ethnicities.Black Alone\",\"Ethnicities.Hispanic or Latino\","
+    "\"Ethnicities.Native Hawaiian and Other Pacific Islander Alone\",\"Ethnicities.Two or More Races\","
+    "\"Ethnicities.White Alone\",\"Ethnicities.White Alone not Hispanic or Latino\",\"Housing.Homeownership Rate\","
+    "\"Housing.Households\",\"Housing.Housing Units\",\"Housing.Median Value of Owner-Occupied Units\","
+    "\"Housing.Persons per Household\",\"Housing.Units in Multi-Unit Structures\",\"Income.Median Household Income\","
+    "\"Income.Per Capita Income\",\"Income.Persons Below Poverty Level\",\"Miscellaneous.Building Permits\","
+    "\"Miscellaneous.Foreign Born\",\"Miscellaneous.Land Area\",\"Miscellaneous.Language Other than English at Home\","
+    "\"Miscellaneous.Living in Same House +1 Years\",\"Miscellaneous.Manufacturers Shipments\","
+    "\"Miscellaneous.Mean Travel Time to Work\",\"Miscellaneous.Percent Female\",\"Miscellaneous.Veterans\","
+    "\"Population.2010 Population\",\"Population.2014 Population\",\"Population.Population Percent Change\","
+    "\"Population.Population per Square Mile\",\"Sales.Accommodation and Food Services Sales\","
+    "\"Sales.Merchant Wholesaler Sales\",\"Sales.Retail Sales\",\"Sales.Retail Sales per Capita\","
+    "\"Employment.Firms.American Indian-Owned\",\"Employment.Firms.Asian-Owned\",\"Employment.Firms.Black-Owned\","
+    "\"Employment.Firms.Hispanic-Owned\",\"Employment.Firms.Native Hawaiian and Other Pacific Islander-Owned\","
+    "\"Employment.Firms.Total\",\"Employment.Firms.Women-Owned\"";
+
+typedef struct {
+    double low, high;
+    int decimals;
+    int log_scale;  // low and high are powers of ten; each decade is equally likely
+} GeneratedColumn;
+
+// Columns after County and State, in header order
+static const GeneratedColumn generated_columns[] = {
+    {3, 50, 1, 0}, {10, 40, 1, 0}, {1, 13, 1, 0}, {3, 75, 1, 0}, {45, 99, 1, 0},
+    {10, 1e6, 0, 1}, {10, 1e6, 0, 1}, {-40, 60, 1, 0}, {1, 1e5, 0, 1},
+    {0, 30, 1, 0}, {0, 40, 1, 0}, {0, 60, 1, 0}, {0, 95, 1, 0}, {0, 10, 1, 0},
+    {0, 15, 1, 0}, {20, 99, 1, 0}, {5, 98, 1, 0},
+    {20, 90, 1, 0}, {10, 1e6, 0, 1}, {10, 1e6, 0, 1}, {1e4, 1e6, 0, 1}, {1.5, 4.5, 2, 0}, {0, 90, 1, 0},
+    {20000, 125000, 0, 0}, {8000, 65000, 0, 0}, {3, 50, 1, 0},
+    {1, 1e4, 0, 1}, {0, 50, 1, 0}, {1, 1e5, 2, 1}, {0, 95, 1, 0}, {65, 99, 1, 0},
+    {1, 1e8, 0, 1}, {5, 45, 1, 0}, {40, 57, 1, 0}, {10, 1e5, 0, 1},
+    {100, 1e7, 0, 1}, {100, 1e7, 0, 1}, {-15, 30, 1, 0}, {0.1, 1e4, 1, 1},
+    {1, 1e7, 0, 1}, {1, 1e8, 0, 1}, {1, 1e8, 0, 1}, {500, 70000, 0, 0},
+    {0, 30, 1, 0}, {0, 25, 1, 0}, {0, 45, 1, 0}, {0, 75, 1, 0}, {0, 5, 1, 0},
+    {10, 1e6, 0, 1}, {0, 50, 1, 0}
+};
+
+#define GENERATED_COLUMN_COUNT ((int)(sizeof(generated_columns) / sizeof(generated_columns[0])))
+
+static const char *const generated_states[] = {
+    "AL", "AK", "AZ", "AR", "CA", "CO", "CT", "DE", "DC", "FL", "GA", "HI", "ID", "IL", "IN", "IA", "KS",
+    "KY", "LA", "ME", "MD", "MA", "MI", "MN", "MS", "MO", "MT", "NE", "NV", "NH", "NJ", "NM", "NY",
+    "NC", "ND", "OH", "OK", "OR", "PA", "RI", "SC", "SD", "TN", "TX", "UT", "VT", "VA", "WA", "WV",
+    "WI", "WY"
+};
+
+#define GENERATED_STATE_COUNT ((int)(sizeof(generated_states) / sizeof(generated_states[0])))
+
+// splitmix64
+uint64_t generator_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Write "value" rounded to the given number of decimals, quoted, at p.
+// Nothing is written at or past end: output that does not fit is cut off
+// and the returned position stays before end.
+char *append_generated_value(char *p, char *end, double value, int decimals) {
+    if (p >= end) {
+        return p;
+    }
+    long long scale = 1;
+    for (int d = 0; d < decimals; d++) {
+        scale *= 10;
+    }
+    long long scaled = (long long)(value * scale + (value < 0 ? -0.5 : 0.5));
+    const char *sign = scaled < 0 ? "-" : "";
+    if (scaled < 0) {
+        scaled = -scaled;
+    }
+    int n = decimals > 0 ? snprintf(p, end - p, "\"%s%lld.%0*lld\"", sign, scaled / scale, decimals, scaled % scale)
+                         : snprintf(p, end - p, "\"%s%lld\"", sign, scaled / scale);
+    return p + (n < 0 ? 0 : n >= end - p ? end - p - 1 : n);
+}
+
+double generate_value(const GeneratedColumn *column, uint64_t *state) {
+    double u = (double)(generator_next(state) >> 11) * 0x1.0p-53;
+    if (!column->log_scale) {
+        return column->low + u * (column->high - column->low);
+    }
+    int decades = 0;
+    for (double d = column->low; d * 10 <= column->high; d *= 10) {
+        decades++;
+    }
+    double scale = column->low;
+    for (int k = (int)(generator_next(state) % decades); k > 0; k--) {
+        scale *= 10;
+    }
+    return scale * (1 + 9 * u);
+}
+
+// Write the header and the given number of synthetic rows to stdout
+int generate_demographics(long long rows) {
+    static char output_buffer[1 << 20];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+    printf("%s\n", demographics_header);
+
+    uint64_t state = 357;
+    char line[2048];
+    for (long long row = 0; row < rows; row++) {
+        char *p = line;
+        // Each row gets its own (County, State) key
+        p += sprintf(p, "\"County %lld\",\"%s\"", row / GENERATED_STATE_COUNT,
+                     generated_states[row % GENERATED_STATE_COUNT]);
+        char *end = line + sizeof(line) - 1;   // room for the newline
+        for (int c = 0; c < GENERATED_COLUMN_COUNT; c++) {
+            if (p < end) {
+                *p++ = ',';
+            }
+            p = append_generated_value(p, end, generate_value(&generated_columns[c], &state),
+                                       generated_columns[c].decimals);
+        }
+        *p++ = '\n';
+        if (fwrite(line, 1, p - line, stdout) != (size_t)(p - line)) {
+            break;
+        }
+    }
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        fprintf(stderr, "Error: Could not write generated rows\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Benchmark (--bench). Times loading the data file, parsing the columns the
+// pipelines read, a filter pipeline, an aggregate pipeline, and all of it
+// end to end, printing one JSON object per stage. Each stage repeats until BENCH_MIN_SECONDS have
+// passed so small files still give stable numbers; times and rates are per
+// run, and MB/s is relative to the size of the data file.
+
+static const char bench_filter_pipeline[] =
+    "filter:Income_Per_Capita_Income:ge:25000 filter:Education_High_School_or_Higher:ge:85";
+static const char bench_aggregate_pipeline[] =
+    "population-total population:Ethnicities_Asian_Alone percent:Income_Persons_Below_Poverty_Level,Ethnicities_Black_Alone";
+
+typedef struct {
+    const char *filename;
+    long long bytes;    // file size, or the column bytes a pipeline scans
+    FILE *sink;         // query output is thrown away
+    int runs;
+    double seconds;     // total over all runs
+} Bench;
+
+void bench_report(const Bench *bench, const char *stage, int rows) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double seconds = bench->seconds / bench->runs;
+    printf("{\"file\":");
+    print_json_string(stdout, bench->filename);
+    printf(",\"stage\":\"%s\",\"threads\":%d,\"kernels\":\"%s\",\"runs\":%d,\"rows\":%d,\"bytes\":%lld,"
+           "\"seconds\":%.6f,\"rows_per_sec\":%.0f,\"mb_per_sec\":%.2f,\"peak_rss_kb\":%ld}\n",
+           stage, configured_thread_count(), kernels->name, bench->runs, rows, bench->bytes,
+           seconds, seconds > 0 ? rows / seconds : 0, seconds > 0 ? bench->bytes / seconds / 1e6 : 0,
+           usage.ru_maxrss);
+    fflush(stdout);
+}
+
+// Load the data file into ds, adding the time taken to the bench
+int bench_load(Bench *bench, Dataset *ds) {
+    double start = now_seconds();
+    if (load_dataset(ds, bench->filename, 0) != 0) {
+        return -1;
+    }
+    bench->seconds += now_seconds() - start;
+    return 0;
+}
+
+void bench_pipeline(Bench *bench, const Dataset *ds, const Operation *ops, int count) {
+    Query q;
+    double start = now_seconds();
+    query_init(&q, ds, bench->sink, bench->sink);
+    run_pipeline(&q, ops, count, NULL);
+    query_free(&q);
+    bench->seconds += now_seconds() - start;
+}
+
+// Bytes of values and validity in the distinct columns the operations read
+long long bench_scanned_bytes(const Dataset *ds, const Operation *ops, int count) {
+    int *fields = xmalloc(((size_t)count * (MAX_PERCENT_FIELDS + FIELD_POPULATION_2014 + 1) + 1) * sizeof(int));
+    int field_total = 0;
+    for (int i = 0; i < count; i++) {
+        field_total += operation_fields(&ops[i], fields + field_total);
+    }
+    long long bytes = 0;
+    for (int i = 0; i < field_total; i++) {
+        int seen = fields[i] < 0;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = fields[j] == fields[i];
+        }
+        if (!seen) {
+            bytes += (long long)ds->row_count * sizeof(int32_t) + (long long)selection_words(ds) * sizeof(uint64_t);
+        }
+    }
+    free(fields);
+    return bytes;
+}
+
+void bench_start(Bench *bench) {
+    bench->runs = 0;
+    bench->seconds = 0;
+}
+
+int bench_done(Bench *bench, double started) {
+    bench->runs++;
+    return now_seconds() - started >= BENCH_MIN_SECONDS;
+}
+
+int run_benchmark(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return 1;
+    }
+    Bench bench = {filename, (long long)st.st_size, fopen("/dev/null", "w"), 0, 0};
+    if (!bench.sink) {
+        fprintf(stderr, "Error: Could not open /dev/null\n");
+        return 1;
+    }
+
+    char filter_copy[sizeof(bench_filter_pipeline)], aggregate_copy[sizeof(bench_aggregate_pipeline)];
+    char end_to_end_copy[sizeof(bench_filter_pipeline) + sizeof(bench_aggregate_pipeline)];
+    memcpy(filter_copy, bench_filter_pipeline, sizeof(filter_copy));
+    memcpy(aggregate_copy, bench_aggregate_pipeline, sizeof(aggregate_copy));
+    snprintf(end_to_end_copy, sizeof(end_to_end_copy), "%s %s", bench_filter_pipeline, bench_aggregate_pipeline);
+    int filter_count, aggregate_count, end_to_end_count;
+    Operation *filter_ops = compile_pipeline(filter_copy, &filter_count);
+    Operation *aggregate_ops = compile_pipeline(aggregate_copy, &aggregate_count);
+    Operation *end_to_end_ops = compile_pipeline(end_to_end_copy, &end_to_end_count);
+
+    // The dataset from the last load is kept for the pipeline stages
+    Dataset ds = {0};
+    double started = now_seconds();
+    bench_start(&bench);
+    for (;;) {
+        if (bench_load(&bench, &ds) != 0) {
+            return 1;
+        }
+        if (bench_done(&bench, started)) {
+            break;
+        }
+        dataset_free(&ds);
+    }
+    bench_report(&bench, "parse", ds.row_count);
+
+    // Parsing the columns both pipelines read, from a fresh load each run
+    started = now_seconds();
+    bench_start(&bench);
+    for (;;) {
+        double start = now_seconds();
+        require_operation_fields(&ds, end_to_end_ops, end_to_end_count);
+        bench.seconds += now_seconds() - start;
+        if (bench_done(&bench, started)) {
+            break;
+        }
+        dataset_free(&ds);
+        if (load_dataset(&ds, filename, 0) != 0) {
+            return 1;
+        }
+    }
+    bench_report(&bench, "materialize", ds.row_count);
+
+    long long file_bytes = bench.bytes;
+    bench.bytes = bench_scanned_bytes(&ds, filter_ops, filter_count);
+    started = now_seconds();
+    bench_start(&bench);
+    do {
+        bench_pipeline(&bench, &ds, filter_ops, filter_count);
+    } while (!bench_done(&bench, started));
+    bench_report(&bench, "filter", ds.row_count);
+
+    bench.bytes = bench_scanned_bytes(&ds, aggregate_ops, aggregate_count);
+    started = now_seconds();
+    bench_start(&bench);
+    do {
+        bench_pipeline(&bench, &ds, aggregate_ops, aggregate_count);
+    } while (!bench_done(&bench, started));
+    bench_report(&bench, "aggregate", ds.row_count);
+
+    int rows = ds.row_count;
+    dataset_free(&ds);
+    bench.bytes = file_bytes;
+    started = now_seconds();
+    bench_start(&bench);
+    do {
+        Dataset fresh = {0};
+        if (bench_load(&bench, &fresh) != 0) {
+            return 1;
+        }
+        bench_pipeline(&bench, &fresh, end_to_end_ops, end_to_end_count);
+        dataset_free(&fresh);
+    } while (!bench_done(&bench, started));
+    bench_report(&bench, "end_to_end", rows);
+
+    free(filter_ops);
+    free(aggregate_ops);
+    free(end_to_end_ops);
+    fclose(bench.sink);
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--threads N] [--kernels scalar|sse|avx2] [--convert <snapshot_file>] [--batch <pipeline_file>] [--upsert <csv_file>] [--serve unix:<path>|tcp:<port> [--incremental]] [--stream] [--profile|--profile-json] <data_file> [<operation1> ...]\n", program);
+    fprintf(stderr, "       %s --generate <rows> > <data_file>\n", program);
+    fprintf(stderr, "       %s [--threads N] [--kernels scalar|sse|avx2] --bench <data_file>\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    // Options come before the data file
+    const char *kernel_option = NULL;
+    const char *snapshot_option = NULL;
+    const char *batch_option = NULL;
+    const char *serve_option = NULL;
+    const char *upsert_option = NULL;
+    int incremental_option = 0;
+    int stream_option = 0;
+    int bench_option = 0;
+    ProfileMode profile_option = PROFILE_OFF;
+    long long generate_rows = -1;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--profile") == 0 || strcmp(argv[arg], "--profile-json") == 0) {
+            profile_option = strcmp(argv[arg], "--profile") == 0 ? PROFILE_TABLE : PROFILE_JSON;
+            arg++;
+        } else if (strcmp(argv[arg], "--bench") == 0) {
+            bench_option = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--generate") == 0 && arg + 1 < argc) {
+            char *end;
+            generate_rows = strtoll(argv[arg + 1], &end, 10);
+            if (*end != '\0' || end == argv[arg + 1] || generate_rows < 0 || generate_rows > INT32_MAX) {
+                fprintf(stderr, "Invalid row count: %s\n", argv[arg + 1]);
+                return 1;
+            }
+            arg += 2;
+        } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+            batch_option = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--convert") == 0 && arg + 1 < argc) {
+            snapshot_option = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--kernels") == 0 && arg + 1 < argc) {
+            kernel_option = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--upsert") == 0 && arg + 1 < argc) {
+            upsert_option = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--incremental") == 0) {
+            incremental_option = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--stream") == 0) {
+            stream_option = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+            serve_option = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            thread_count_option = atoi(argv[arg + 1]);
+            if (thread_count_option < 1) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[arg + 1]);
+                return 1;
+            }
+            arg += 2;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Stages are kept until exit, so a long-running server is not profiled
+    if (profile_option != PROFILE_OFF) {
+        if (serve_option || bench_option || generate_rows >= 0) {
+            fprintf(stderr, "Error: --profile cannot be combined with --serve, --bench or --generate\n");
+            return 1;
+        }
+        profile_mode = profile_option;
+        atexit(print_profile);
+    }
+
+    if (generate_rows >= 0) {
+        if (arg != argc) {
+            fprintf(stderr, "Invalid argument count\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+        return generate_demographics(generate_rows);
+    }
+
+    // --convert, --batch, --serve and --bench may be used without any operations
+    if (argc - arg < (snapshot_option || batch_option || serve_option || bench_option ? 1 : 2)) {
+        fprintf(stderr, "Invalid argument count\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *data_file = argv[arg];
+
+    if (select_kernels(kernel_option) != 0) {
+        fprintf(stderr, "Unsupported kernel set: %s\n", kernel_option);
+        return 1;
+    }
+
+    // Resolve every operation before scanning any rows, which for piped
+    // inputs means reading them first
+    init_field_lookup();
+    MappedFile data_input, upsert_input;
+    char *stream_head = NULL;
+    size_t stream_head_length = 0;
+    int stream_fd = -1;
+    int data_piped = 0, upsert_piped = 0;
+    if (stream_option) {
+        stream_fd = preread_stream_input(data_file, &stream_head, &stream_head_length);
+    } else {
+        data_piped = preread_input(data_file, &data_input);
+    }
+    if (upsert_option) {
+        upsert_piped = preread_input(upsert_option, &upsert_input);
+    }
+    int operation_count = argc - arg - 1;
+    Operation *operations = xcalloc(operation_count + 1, sizeof(Operation));
+    for (int i = 0; i < operation_count; i++) {
+        compile_operation(argv[arg + 1 + i], &operations[i]);
+    }
+
+    if (bench_option) {
+        if (operation_count > 0 || stream_option || snapshot_option || batch_option || serve_option || upsert_option) {
+            fprintf(stderr, "Error: --bench takes only a data file\n");
+            return 1;
+        }
+        free(operations);
+        return run_benchmark(data_file);
+    }
+
+    // Streaming runs the operations while reading, without loading the file
+    if (stream_option) {
+        if (snapshot_option || batch_option || serve_option || upsert_option) {
+            fprintf(stderr, "Error: --stream cannot be combined with --convert, --batch, --serve or --upsert\n");
+            return 1;
+        }
+        int status = stream_operations(data_file, stream_fd, stream_head, stream_head_length, operations, operation_count);
+        free(operations);
+        return status;
+    }
+
+    // A reload would drop rows upserted from another file
+    if (upsert_option && serve_option) {
+        fprintf(stderr, "Error: --upsert cannot be combined with --serve\n");
+        return 1;
+    }
+    if (incremental_option && !serve_option) {
+        fprintf(stderr, "Error: --incremental requires --serve\n");
+        return 1;
+    }
+
+    // Parse the demographics file
+    Dataset dataset = {0};
+    ProfileMark load_mark = profile_begin();
+    // A served file can be rewritten while it is in use, so it is copied
+    int load_status = parse_demographics_file(&dataset, data_file, data_piped ? &data_input : NULL, serve_option != NULL);
+    profile_end(&load_mark, "load", -1, dataset.row_count);
+    if (load_status != 0) {
+        // Operations still run, over no rows, but there is nothing to save or serve
+        if (snapshot_option || serve_option) {
+            return 1;
+        }
+        dataset_init_empty(&dataset);
+    }
+
+    // Apply rows from another file on top, keyed by (County, State). Only
+    // the fields the operations read are kept, unless a snapshot or batch
+    // file may need any of them.
+    if (upsert_option) {
+        int *fields = NULL, field_count = 0;
+        if (!snapshot_option && !batch_option) {
+            fields = xmalloc(((size_t)operation_count * (MAX_PERCENT_FIELDS + FIELD_POPULATION_2014 + 1) + 1) * sizeof(int));
+            for (int i = 0; i < operation_count; i++) {
+                field_count += operation_fields(&operations[i], fields + field_count);
+            }
+        }
+        int status = upsert_file(&dataset, upsert_option, upsert_piped ? &upsert_input : NULL, fields, field_count);
+        free(fields);
+        if (status != 0) {
+            return 1;
+        }
+    }
+
+    // Save what was loaded as a snapshot for faster loading next time
+    if (snapshot_option) {
+        if (write_snapshot(&dataset, snapshot_option) != 0) {
+            return 1;
+        }
+        printf("Snapshot written to %s\n", snapshot_option);
+    }
+
+    if (batch_option) {
+        return run_batch_file(&dataset, batch_option);
+    }
+
+    if (serve_option) {
+        return run_server(&dataset, data_file, serve_option, incremental_option);
+    }
+
+    Query query;
+    query_init(&query, &dataset, stdout, stderr);
+    int status = run_pipeline(&query, operations, operation_count, NULL);
+    query_free(&query);
+    free(operations);
+    return status;
+}
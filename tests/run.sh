@@ -0,0 +1,198 @@
+#!/bin/bash
+# Golden-output tests (make test). Each case in tests/cases is run from the
+# repository root and passes if what it printed to stdout and stderr and
+# its exit status match tests/expected/<name>.out. TMP in a case's
+# arguments and output stands for a scratch directory holding the files
+# prepared below.
+#
+# Every case is also run over snapshots of its CSV data files, with each
+# kernel set (--kernels) the machine supports and with 1, 3 and 8 threads,
+# which must all give the same output. TMP/generated.csv is large enough
+# to be parsed and scanned in parallel.
+#
+# Usage: tests/run.sh [binary]          run every case and the reload test
+#        tests/run.sh --update [binary] rewrite the expected outputs
+
+cd "$(dirname "$0")/.." || exit 1
+update=0
+if [ "$1" = "--update" ]; then
+    update=1
+    shift
+fi
+bin=${1:-./main.out}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+passed=0
+failed=0
+
+mkdir -p "$tmp/snapshots"
+"$bin" --convert "$tmp/small.snap" small.csv > /dev/null
+head -c 4096 "$tmp/small.snap" > "$tmp/truncated.snap"
+"$bin" --generate 50000 > "$tmp/generated.csv"
+
+kernel_sets=
+for set in scalar sse avx2; do
+    if "$bin" --kernels $set small.csv population-total > /dev/null 2>&1; then
+        kernel_sets="$kernel_sets $set"
+    fi
+done
+
+# Print what the binary printed for the given arguments, then its status
+run() {
+    "$bin" "${@//TMP/$tmp}" > "$tmp/stdout" 2> "$tmp/stderr"
+    local status=$?
+    sed "s|$tmp|TMP|g" "$tmp/stdout"
+    echo "--- stderr"
+    sed "s|$tmp|TMP|g" "$tmp/stderr"
+    echo "--- exit $status"
+}
+
+# Print the arguments with each CSV data file (not an --upsert file)
+# replaced by a snapshot of it, converting it the first time
+snapshot_args() {
+    local previous= arg
+    for arg in "$@"; do
+        if [[ $arg == *.csv && -f ${arg/TMP/$tmp} && $previous != --upsert ]]; then
+            local name=${arg#TMP/}
+            local snapshot="TMP/snapshots/${name//\//_}.snap"
+            if [ ! -f "${snapshot/TMP/$tmp}" ]; then
+                "$bin" --convert "${snapshot/TMP/$tmp}" "${arg/TMP/$tmp}" > /dev/null
+            fi
+            arg=$snapshot
+        fi
+        echo "$arg"
+        previous=$arg
+    done
+}
+
+# check <name> <variant> <arguments...>: compare a run with case name's expected output
+check() {
+    local name=$1 variant=$2
+    shift 2
+    run "$@" > "$tmp/actual"
+    if cmp -s "$tmp/actual" "tests/expected/$name.out"; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL: $name ($variant)"
+        diff "tests/expected/$name.out" "$tmp/actual" | head -n 10
+    fi
+}
+
+while read -r name args; do
+    case $name in
+        '' | '#'*) continue ;;
+    esac
+    if [ $update = 1 ]; then
+        run $args > "tests/expected/$name.out"
+        continue
+    fi
+    check "$name" default $args
+    if [[ " $args " != *" --stream "* ]]; then
+        check "$name" snapshot $(snapshot_args $args)
+    fi
+    for set in $kernel_sets; do
+        check "$name" "--kernels $set" --kernels $set $args
+    done
+    for threads in 1 3 8; do
+        check "$name" "--threads $threads" --threads $threads $args
+    done
+done < tests/cases
+
+# Reloads: a server on a copy of TMP/generated.csv is asked the queries
+# below, the copy is rewritten in place, and after a reload the same
+# queries must be answered for the new contents. The edits are appended
+# rows, a changed row and deleted rows; a changed header makes an
+# incremental reload load the file in full. The transcript must not depend
+# on the reload being incremental or on the thread count.
+queries=("population-total"
+         "filter-state:WY top:Income_Per_Capita_Income:3"
+         "filter-state:NJ filter:Population_Population_2014:le:112 sort:Population_Population_2014:asc"
+         "filter-state:AL filter:Population_Population_2014:le:60000 percent:Income_Persons_Below_Poverty_Level")
+
+# ask <request>: send a request to the server on fd 3 and print the reply
+ask() {
+    echo "> $1"
+    echo "$1" >&3
+    local line
+    while IFS= read -r -t 30 line <&3; do
+        echo "$line"
+        [[ $line == 'END '* ]] && return
+    done
+    echo "(no reply)"
+}
+
+# The edits, each rewriting the served file in place
+append_rows() {
+    tail -n +2 tests/data/updates.csv >> "$tmp/served.csv"
+}
+change_rows() {
+    awk -F, -v OFS=, 'NR == 1001 { $1 = "\"Renamed County\""; $39 = "\"107\"" } 1' \
+        "$tmp/served.csv" > "$tmp/edited.csv"
+    cat "$tmp/edited.csv" > "$tmp/served.csv"
+}
+delete_rows() {
+    sed 20000,20099d "$tmp/served.csv" > "$tmp/edited.csv"
+    cat "$tmp/edited.csv" > "$tmp/served.csv"
+}
+change_header() {
+    sed '1s/"County"/"Name"/' "$tmp/served.csv" > "$tmp/edited.csv"
+    cat "$tmp/edited.csv" > "$tmp/served.csv"
+}
+
+# Print the transcript of a server run with the given options
+serve() {
+    cp "$tmp/generated.csv" "$tmp/served.csv"
+    local port server attempt
+    for attempt in 1 2 3 4 5; do
+        port=$((20000 + RANDOM % 20000))
+        "$bin" "$@" --serve tcp:$port "$tmp/served.csv" > "$tmp/server.log" 2>&1 &
+        server=$!
+        while kill -0 $server 2> /dev/null && ! grep -q '^Serving' "$tmp/server.log"; do
+            sleep 0.1
+        done
+        grep -q '^Serving' "$tmp/server.log" && break
+        wait $server
+    done
+    if ! exec 3<> /dev/tcp/127.0.0.1/$port; then
+        kill $server
+        wait $server
+        return
+    fi
+    local query edit
+    for edit in append_rows change_rows delete_rows change_header; do
+        for query in "${queries[@]}"; do
+            ask "$query"
+        done
+        echo "# $edit"
+        $edit
+        ask reload | sed "s|$tmp|TMP|g"
+    done
+    for query in "${queries[@]}"; do
+        ask "$query"
+    done
+    echo quit >&3
+    exec 3>&-
+    kill $server
+    wait $server
+}
+
+for options in "--incremental" "" "--threads 1 --incremental" "--threads 8 --incremental"; do
+    if [ $update = 1 ]; then
+        serve --incremental > tests/expected/reload.out
+        break
+    fi
+    serve $options > "$tmp/actual"
+    if cmp -s "$tmp/actual" tests/expected/reload.out; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL: reload ($options)"
+        diff tests/expected/reload.out "$tmp/actual" | head -n 10
+    fi
+done
+
+if [ $update = 0 ]; then
+    echo "$passed passed, $failed failed"
+fi
+[ $failed = 0 ]